@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lockin-stream.h"
+#include "lockin/spsc_queue.hpp"
+#include "lockin/transport.hpp"
+
+namespace lockin {
+
+struct capture_frame {
+    stream_frame_header_t header;
+    std::vector<uint8_t> payload;
+
+    // Samples of one channel of a capture frame, the reference being channel 0
+    const uint16_t* channel(unsigned index) const {
+        return reinterpret_cast<const uint16_t*>(payload.data()) + index * header.channel_length;
+    }
+};
+
+// Console line made only of comma separated numbers, like the ones of the monitor mode
+struct result {
+    double time_s;
+    std::vector<double> values;
+};
+
+struct client_statistics {
+    uint64_t frames = 0;
+    uint64_t data_bytes = 0;
+    // Frames dropped by the device (counted in the frame headers), and by the client when the callbacks fell behind
+    uint64_t device_dropped = 0;
+    uint64_t host_dropped = 0;
+    // Times the data stream had to be searched for the next frame header
+    uint64_t resyncs = 0;
+};
+
+// Reads the binary stream and the console of the device on background threads, and hands the frames, results and
+// console lines over lock-free queues to a dispatch thread that runs the callbacks. The readers never wait for the
+// callbacks, so slow ones only make the client drop frames
+class client {
+public:
+    using frame_callback = std::function<void(const capture_frame&)>;
+    using result_callback = std::function<void(const result&)>;
+    using line_callback = std::function<void(const std::string&)>;
+
+    explicit client(std::unique_ptr<transport> device, size_t queue_capacity = 1024);
+    ~client();
+
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+
+    // The callbacks run on the dispatch thread, and have to be set before starting
+    void on_frame(frame_callback callback) { frame_handler = std::move(callback); }
+    void on_result(result_callback callback) { result_handler = std::move(callback); }
+    void on_console_line(line_callback callback) { line_handler = std::move(callback); }
+
+    void start();
+    // Stops reading, then runs the callbacks of whatever was already queued
+    void stop();
+
+    // Console commands, like S to start the capture stream and Q to stop it
+    void send(const std::string& command);
+
+    client_statistics statistics() const;
+
+    // Throws the error that stopped a reader thread, if any
+    void check() const;
+
+private:
+    void read_data();
+    void read_console();
+    void dispatch();
+    void fail(std::exception_ptr exception);
+
+    std::unique_ptr<transport> device;
+
+    spsc_queue<capture_frame> frames;
+    spsc_queue<std::string> lines;
+
+    frame_callback frame_handler;
+    result_callback result_handler;
+    line_callback line_handler;
+
+    std::atomic<bool> reading{false};
+    std::atomic<bool> dispatching{false};
+    std::thread data_thread;
+    std::thread console_thread;
+    std::thread dispatch_thread;
+
+    std::atomic<uint64_t> frame_count{0};
+    std::atomic<uint64_t> data_bytes{0};
+    std::atomic<uint64_t> device_dropped{0};
+    std::atomic<uint64_t> host_dropped{0};
+    std::atomic<uint64_t> resyncs{0};
+
+    mutable std::mutex error_mutex;
+    std::exception_ptr error;
+};
+
+}
@@ -0,0 +1,97 @@
+#ifndef LOCKIN_FIRMWARE_H
+#define LOCKIN_FIRMWARE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockin-stream.h"
+
+// The processing of the firmware (lockin-pico.c) built for the host, with an emulation of the SDK that plays back
+// recorded captures instead of sampling. Every thread has its own firmware state, so threads can replay different
+// measurements at the same time, once each of them has called firmware_init
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A recorded capture frame, as streamed by the firmware
+typedef struct {
+    const stream_frame_header_t* header;
+    // header->channel_count channels of header->channel_length raw ADC codes, one after the other
+    const uint16_t* samples;
+} firmware_capture_t;
+
+// Loads an image of the device flash (from its start), so the firmware finds its ADC correction and profile in it.
+// It's shared by every thread, so only load it before they start
+bool firmware_load_flash(const uint8_t* image, size_t size);
+
+// Sets up the calling thread like the firmware does when booting, loading the ADC correction and the profile
+bool firmware_init(void);
+
+// Selects a measurement profile of the firmware by name, and gives the captures its measurements average
+bool firmware_select_profile(const char* name);
+const char* firmware_get_profile(void);
+uint32_t firmware_get_iterations(void);
+
+// Profiles of the firmware, from 0 in the order its P command lists them (from 1)
+uint32_t firmware_get_profile_count(void);
+const char* firmware_get_profile_name(uint32_t index);
+
+// Plans the sampling for the frequency of a recorded capture, which has to end up with the same capture layout.
+// It also starts the phase tracker over
+bool firmware_init_sampling(const stream_frame_header_t* header);
+
+// The phase tracker carries the reference phase from one capture to the next, so measurements replayed apart only
+// match the device when each starts from the state the ones before left. Without phase tracking there's no state
+bool firmware_tracks_phase(void);
+size_t firmware_get_tracker_state_size(void);
+void firmware_save_tracker_state(void* state);
+void firmware_restore_tracker_state(const void* state);
+
+// Runs only the phase tracker over the captures, in order, leaving it as measuring them would
+void firmware_track_phase(const firmware_capture_t* captures, uint32_t count);
+
+// Sampling plan and capture layout the firmware would stream for a frequency, filling those fields of the header.
+// It doesn't touch the state of the calling thread, so it needs no firmware_init
+bool firmware_plan_sampling(double frequency_hz, stream_frame_header_t* header);
+
+// System clock of the firmware, which times the PWM and the ADC
+uint32_t firmware_get_clock_frequency(void);
+
+// DUT positions of the firmware, every DUT input on every multiplexer channel
+uint32_t firmware_get_dut_position_count(void);
+
+// Captures taken by a measurement of the given iterations (every multiplexer channel takes its own)
+uint32_t firmware_get_measurement_captures(uint32_t iterations);
+
+// Voltages of a measurement with the selected profile: every harmonic (and tone) of the first DUT position, then
+// the ones of the next (only the fundamentals with the 4-point demodulator)
+uint32_t firmware_get_voltage_count(void);
+
+// Runs a measurement over the captures, giving its voltages as pairs of real and imaginary parts in ADC units
+bool firmware_measure(const firmware_capture_t* captures, uint32_t iterations, double* voltages, double* temperature_c);
+
+// Takes a single capture and searches its reference for the zero crossing like the firmware does without phase
+// tracking, giving its position in 1/2^CROSSING_FRACTION_BITS samples, or UINT32_MAX when there's none
+uint32_t firmware_find_zero_crossing(const firmware_capture_t* capture);
+
+// Correlations of a measurement: every demodulated frequency (harmonic and tone) of each DUT input
+uint32_t firmware_get_correlation_count(void);
+
+// Takes a single capture and correlates the DUT inputs from the reference crossing with the table kernel or the
+// interpolator one, giving the sine and cosine sums of every correlation, or false when there's no crossing
+bool firmware_correlate(const firmware_capture_t* capture, bool interpolator, int64_t* sines, int64_t* cosines);
+
+// Frequency of a voltage of the last measurement, which follows the reference when tracking its phase
+double firmware_get_voltage_frequency(uint32_t index);
+
+// Component value from the open circuit and DUT voltages (pairs of real and imaginary parts), as in the firmware
+double firmware_get_component_value(const double* open_voltage, const double* dut_voltage, char component,
+    double frequency_hz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lockin-stream.h"
+#include "lockin/transport.hpp"
+
+namespace lockin {
+
+// What the mock device measures. Its captures have the plan and layout the firmware would use for the frequency
+struct mock_settings {
+    double frequency_hz = 500;
+    // Amplitudes in ADC codes, and phase of each DUT input relative to the reference
+    double reference_amplitude = 1000;
+    double dut_amplitude = 500;
+    double dut_phase_deg = -30;
+    double noise_codes = 2;
+    // Relative noise of the voltages reported by the monitor mode
+    double monitor_noise = 1e-4;
+    double monitor_period_s = 0.1;
+    // Bytes per second the data interface can carry, full speed bulk by default
+    double link_bytes_per_s = 19 * 64 * 1000;
+    uint32_t seed = 1;
+};
+
+// Emulates the console and the binary stream of the firmware without any hardware, waiting at its first prompt
+// (before the calibration) with the commands that work at every prompt: S streams capture frames, U test frames,
+// M monitors the voltages, D dumps an empty log, P followed by its number selects a profile, and Q stops any of
+// them. The captures come at the rate of a real capture and leave at the rate of the link, dropping the ones that
+// find both frame buffers full
+class mock_device : public transport {
+public:
+    explicit mock_device(const mock_settings& settings = mock_settings());
+
+    void write_console(const std::string& text) override;
+    size_t read_console(char* buffer, size_t size, int timeout_ms) override;
+    size_t read_data(uint8_t* buffer, size_t size, int timeout_ms) override;
+
+    // Sampling plan of the emulated captures, as it appears in the frame headers
+    const stream_frame_header_t& plan() const { return plan_header; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    enum class mode { idle, capture_stream, test_stream, monitor };
+
+    void update(clock::time_point now);
+    void add_frame(uint32_t type, clock::time_point start);
+    void print(const std::string& text);
+    void print_prompt();
+
+    mock_settings settings;
+    stream_frame_header_t plan_header;
+    clock::time_point boot_time;
+    std::mt19937 random;
+
+    std::mutex mutex;
+    mode current_mode = mode::idle;
+    std::string console_output;
+
+    // Profile of the firmware, and whether the next character is the number of the one to select
+    uint32_t profile_index = 0;
+    bool selecting_profile = false;
+
+    // Frames waiting for the link, at most two like the double buffer of the firmware
+    std::deque<std::vector<uint8_t>> frames;
+    size_t frame_offset = 0;
+    uint32_t sequence = 0;
+    uint32_t dropped_count = 0;
+    clock::time_point next_capture;
+    clock::time_point link_time;
+    double link_credit = 0;
+
+    // Throughput reports of the stream
+    clock::time_point stream_start;
+    clock::time_point report_time;
+    uint64_t sent_bytes = 0;
+    uint64_t report_sent_bytes = 0;
+
+    clock::time_point monitor_start;
+    clock::time_point next_monitor;
+    uint32_t monitor_count = 0;
+};
+
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lockin {
+
+// Recording file layout, all little endian:
+//   recording_header, padded to header_size
+//   chunks, each a chunk_header followed by payload_size bytes:
+//     record chunks hold records, each a record_header followed by its data padded to 8 bytes
+//     index chunks hold the offset of the previous index chunk (0 for none) and the index_entry of every record
+//     chunk since it
+//   recording_trailer, only once the recording was closed
+// Everything after the header is only ever appended. Readers follow the index chunks back from the trailer, or
+// scan the chunks when there's no trailer because the recording didn't finish
+
+constexpr char recording_magic[8] = { 'L', 'K', 'I', 'N', 'R', 'E', 'C', '1' };
+constexpr uint32_t recording_version = 1;
+constexpr uint32_t chunk_magic = 0x4B4E4843;
+constexpr uint32_t trailer_magic = 0x444E454C;
+constexpr size_t max_calibration_values = 32;
+
+struct recording_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // Wall clock time the recording started, in microseconds since the epoch
+    int64_t created_us;
+    // Excitation frequency of the measurement, and name of the measurement profile
+    double frequency_hz;
+    char profile[32];
+    // Open circuit voltages of every DUT position and frequency, as pairs of real and imaginary parts
+    uint32_t calibration_count;
+    uint32_t reserved;
+    double calibration[2 * max_calibration_values];
+};
+
+enum chunk_type : uint32_t {
+    chunk_records = 1,
+    chunk_index = 2
+};
+
+struct chunk_header {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t record_count;
+    uint32_t payload_size;
+    // Timestamps of the first and last record, for record chunks
+    int64_t first_us;
+    int64_t last_us;
+};
+
+enum record_type : uint32_t {
+    // A stream frame as sent by the device, header and payload
+    record_frame = 1,
+    // A result, as the time in seconds followed by the values, all doubles
+    record_result = 2
+};
+
+struct record_header {
+    // Wall clock time the record was received, in microseconds since the epoch, never decreasing
+    int64_t timestamp_us;
+    uint32_t type;
+    uint32_t size;
+};
+
+struct index_entry {
+    int64_t first_us;
+    uint64_t offset;
+};
+
+struct recording_trailer {
+    uint64_t last_index_offset;
+    uint32_t magic;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(recording_header) == 584, "Unexpected padding in the recording header");
+static_assert(sizeof(chunk_header) == 32, "Unexpected padding in the chunk header");
+static_assert(sizeof(record_header) == 16, "Unexpected padding in the record header");
+
+// Settings of the measurement, saved in the recording header
+struct recording_info {
+    double frequency_hz = 0;
+    std::string profile;
+    std::vector<std::complex<double>> calibration;
+};
+
+// Appends records to a new recording, gathering them into chunks of about chunk_size bytes (or chunk_us of time)
+// and writing an index chunk every index_interval chunks. Errors are thrown as std::runtime_error
+class recording_writer {
+public:
+    recording_writer(const std::string& path, const recording_info& info, size_t chunk_size = 1 << 20,
+        int64_t chunk_us = 1000000, size_t index_interval = 64);
+    ~recording_writer();
+
+    recording_writer(const recording_writer&) = delete;
+    recording_writer& operator=(const recording_writer&) = delete;
+
+    void append(int64_t timestamp_us, record_type type, const void* data, size_t size);
+
+    // The frequency may only be known once the first frame arrives, so the header can still be updated
+    void set_frequency(double frequency_hz);
+
+    // Writes the last chunk, the last index and the trailer
+    void close();
+
+    uint64_t bytes_written() const { return file_offset; }
+
+private:
+    void write(const void* data, size_t size);
+    void write_header();
+    void flush_chunk();
+    void flush_index();
+
+    int fd = -1;
+    recording_header header;
+    uint64_t file_offset = 0;
+
+    size_t chunk_size;
+    int64_t chunk_us;
+    size_t index_interval;
+
+    std::vector<uint8_t> chunk;
+    chunk_header current_chunk;
+    int64_t last_timestamp_us = INT64_MIN;
+
+    std::vector<index_entry> pending_index;
+    uint64_t last_index_offset = 0;
+};
+
+// A record inside a mapped recording
+struct record_view {
+    int64_t timestamp_us;
+    record_type type;
+    const uint8_t* data;
+    size_t size;
+};
+
+// Maps a recording into memory, and finds records by timestamp with a binary search of the index. A recording
+// whose index or records point outside of their chunks is thrown as std::runtime_error instead of being read
+class recording_reader {
+public:
+    explicit recording_reader(const std::string& path);
+    ~recording_reader();
+
+    recording_reader(const recording_reader&) = delete;
+    recording_reader& operator=(const recording_reader&) = delete;
+
+    const recording_header& header() const { return *reinterpret_cast<const recording_header*>(base); }
+    recording_info info() const;
+
+    // Whether the recording was closed, otherwise the index comes from scanning the chunks
+    bool complete() const { return has_trailer; }
+    size_t chunk_count() const { return index.size(); }
+
+    // Walks through the records in order, from the one at position or the first one after it
+    class cursor {
+    public:
+        bool next(record_view& record);
+
+    private:
+        friend class recording_reader;
+        const recording_reader* reader = nullptr;
+        size_t chunk = 0;
+        size_t offset = 0;
+    };
+
+    cursor begin() const;
+    cursor seek(int64_t timestamp_us) const;
+
+private:
+    void load_index();
+    void scan_chunks();
+    const chunk_header* chunk_at(size_t position) const;
+
+    int fd = -1;
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+    bool has_trailer = false;
+    std::vector<index_entry> index;
+};
+
+}
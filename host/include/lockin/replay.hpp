@@ -0,0 +1,52 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lockin {
+
+struct replay_settings {
+    // Captures averaged by every measurement, 0 for the iterations of the recorded profile
+    unsigned iterations = 0;
+    // Threads replaying measurements, 0 for one per hardware thread
+    unsigned threads = 0;
+    // Measurements a thread replays in a row. Each of them starts from the phase tracker state the measurements
+    // before left, so the results don't depend on how they're split
+    unsigned task_measurements = 16;
+    // Component calculated from the calibration in the recording, R or C
+    char component = 'R';
+};
+
+struct replay_measurement {
+    // Record timestamp of the first capture, and device time when it started
+    int64_t timestamp_us = 0;
+    double time_s = 0;
+    double temperature_c = 0;
+    // Voltages of every DUT position in ADC units, in the order of the firmware, with their frequencies
+    std::vector<std::complex<double>> voltages;
+    std::vector<double> frequencies_hz;
+    // Component values, when the recording has the open circuit voltage of every DUT position and frequency
+    std::vector<double> values;
+};
+
+struct replay_file {
+    std::string path;
+    std::string profile;
+    unsigned iterations = 0;
+    uint64_t captures = 0;
+    uint64_t capture_bytes = 0;
+    // Measurements in recording order, after the captures that didn't make up a whole one were left out
+    std::vector<replay_measurement> measurements;
+};
+
+// Loads an image of the device flash, so the replay uses its ADC correction (and profile, when the recordings
+// don't name one). Only before replaying
+void load_flash_image(const std::string& path);
+
+// Runs the captures of every recording through the processing of the firmware, spreading the measurements of all
+// the files over the threads. Errors are thrown as std::runtime_error
+std::vector<replay_file> replay(const std::vector<std::string>& paths, const replay_settings& settings);
+
+}
@@ -0,0 +1,260 @@
+#ifndef LOCKIN_SDK_EMULATION_H
+#define LOCKIN_SDK_EMULATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockin/firmware.h"
+
+// The parts of the Pico SDK used by the firmware, for building its processing on the host. The capture path (ADC,
+// DMA, PWM counters and the time) plays back recorded captures, every thread with its own emulated hardware, and
+// whatever only matters on the device does nothing. It's C, included by host/src/firmware.c right before the firmware
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+// The processing state of the firmware is kept per thread, like the emulated hardware
+#define PROCESSING_STATE _Thread_local
+
+#define __not_in_flash_func(function) function
+#define __scratch_x(name)
+
+// Captures played back in order by the emulated ADC and DMA of the calling thread, one every time the firmware
+// starts a capture. Starting one after the last is an error, as the firmware would wait for it forever
+void emulation_set_captures(const firmware_capture_t* captures, uint count);
+
+// Emulated flash, erased until an image of the device flash is loaded (see firmware_load_flash)
+#define PICO_FLASH_SIZE_BYTES (2u * 1024 * 1024)
+#define FLASH_SECTOR_SIZE 4096u
+#define FLASH_PAGE_SIZE 256u
+extern uint8_t emulated_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE ((uintptr_t) emulated_flash)
+// End of the firmware image, which takes no room in the emulated flash
+extern char __flash_binary_end;
+void flash_range_erase(uint32_t offset, size_t count);
+void flash_range_program(uint32_t offset, const uint8_t* data, size_t count);
+
+// Time, which stands still at the start of the capture being played back
+uint64_t time_us_64(void);
+static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+static inline uint32_t to_ms_since_boot(absolute_time_t time) { return time / 1000; }
+static inline void sleep_us(uint64_t us) { (void) us; }
+static inline void sleep_ms(uint32_t ms) { (void) ms; }
+static inline void tight_loop_contents(void) {}
+static inline void __wfi(void) {}
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void) status; }
+
+static inline bool set_sys_clock_hz(uint32_t frequency_hz, bool required) { (void) frequency_hz; return required; }
+static inline bool stdio_init_all(void) { return true; }
+#define PICO_ERROR_TIMEOUT (-1)
+static inline int getchar_timeout_us(uint32_t timeout_us) { (void) timeout_us; return PICO_ERROR_TIMEOUT; }
+
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t* timer);
+struct repeating_timer {
+    int64_t delay_us;
+    repeating_timer_callback_t callback;
+    void* user_data;
+};
+static inline bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void* user_data,
+    repeating_timer_t* timer) {
+    (void) delay_us, (void) callback, (void) user_data, (void) timer;
+    return false;
+}
+static inline bool cancel_repeating_timer(repeating_timer_t* timer) { (void) timer; return false; }
+
+// Capture completion queue, a real one as the emulated DMA interrupt publishes into it
+typedef struct {
+    uint8_t* data;
+    uint element_size;
+    uint element_count;
+    uint head;
+    uint count;
+} queue_t;
+void queue_init(queue_t* queue, uint element_size, uint element_count);
+bool queue_try_add(queue_t* queue, const void* element);
+bool queue_try_remove(queue_t* queue, void* element);
+static inline bool queue_is_empty(queue_t* queue) { return queue->count == 0; }
+
+// GPIO, with every input reading high
+#define GPIO_IN false
+#define GPIO_OUT true
+#define GPIO_FUNC_PWM 4
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+static inline void gpio_init(uint gpio) { (void) gpio; }
+static inline void gpio_init_mask(uint32_t mask) { (void) mask; }
+static inline void gpio_set_dir(uint gpio, bool out) { (void) gpio, (void) out; }
+static inline void gpio_set_dir_out_masked(uint32_t mask) { (void) mask; }
+static inline void gpio_set_function(uint gpio, int function) { (void) gpio, (void) function; }
+static inline void gpio_pull_up(uint gpio) { (void) gpio; }
+static inline void gpio_put(uint gpio, bool value) { (void) gpio, (void) value; }
+static inline void gpio_put_masked(uint32_t mask, uint32_t value) { (void) mask, (void) value; }
+static inline bool gpio_get(uint gpio) { (void) gpio; return true; }
+static inline void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) { (void) gpio, (void) events, (void) enabled; }
+static inline void gpio_acknowledge_irq(uint gpio, uint32_t events) { (void) gpio, (void) events; }
+static inline void gpio_add_raw_irq_handler(uint gpio, void (*handler)(void)) { (void) gpio, (void) handler; }
+
+// Interrupts, where only the DMA one is ever raised
+#define DMA_IRQ_0 11
+#define IO_IRQ_BANK0 13
+#define USBCTRL_IRQ 5
+#define FIRST_USER_IRQ 26
+#define NUM_USER_IRQS 6
+#define PICO_HIGHEST_IRQ_PRIORITY 0
+void irq_set_exclusive_handler(uint irq, void (*handler)(void));
+void irq_set_enabled(uint irq, bool enabled);
+bool irq_is_enabled(uint irq);
+static inline void irq_set_priority(uint irq, uint8_t priority) { (void) irq, (void) priority; }
+
+enum clock_index { clk_gpout0, clk_gpout1, clk_gpout2, clk_gpout3, clk_ref, clk_sys, clk_peri, clk_usb, clk_adc, clk_rtc };
+#define CLOCKS_CLK_ADC_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS 0
+static inline bool clock_configure(enum clock_index clock, uint32_t source, uint32_t auxiliary_source,
+    uint32_t source_frequency, uint32_t frequency) {
+    (void) clock, (void) source, (void) auxiliary_source, (void) source_frequency, (void) frequency;
+    return true;
+}
+
+// PWM, where the counter of a slice reads as the recorded counter of the tone it was set up for
+static inline uint pwm_gpio_to_slice_num(uint gpio) { return (gpio >> 1) & 7; }
+static inline uint pwm_gpio_to_channel(uint gpio) { return gpio & 1; }
+static inline void pwm_set_clkdiv_int_frac(uint slice, uint8_t integer, uint8_t fraction) { (void) slice, (void) integer, (void) fraction; }
+void pwm_set_wrap(uint slice, uint16_t wrap);
+static inline void pwm_set_chan_level(uint slice, uint channel, uint16_t level) { (void) slice, (void) channel, (void) level; }
+static inline void pwm_set_enabled(uint slice, bool enabled) { (void) slice, (void) enabled; }
+static inline void pwm_set_mask_enabled(uint32_t mask) { (void) mask; }
+static inline void pwm_set_counter(uint slice, uint16_t count) { (void) slice, (void) count; }
+uint16_t pwm_get_counter(uint slice);
+
+// ADC, which runs a capture of the DMA round robin when started, and reads the recorded temperature sensor code
+// of the last capture in a single conversion
+#define ADC_BASE_PIN 26
+#define ADC_TEMPERATURE_CHANNEL_NUM 4
+#define ADC_CS_READY_BITS 0x00000100
+typedef struct {
+    volatile uint32_t cs;
+    volatile uint32_t result;
+    volatile uint32_t fcs;
+    volatile uint32_t fifo;
+    volatile uint32_t div;
+} adc_hw_t;
+adc_hw_t* emulated_adc_hw(void);
+#define adc_hw (emulated_adc_hw())
+void adc_init(void);
+static inline void adc_gpio_init(uint gpio) { (void) gpio; }
+void adc_select_input(uint input);
+uint16_t adc_read(void);
+static inline void adc_set_round_robin(uint mask) { (void) mask; }
+static inline void adc_set_temp_sensor_enabled(bool enabled) { (void) enabled; }
+static inline void adc_set_clkdiv(float divider) { (void) divider; }
+static inline void adc_fifo_setup(bool enabled, bool dreq, uint16_t threshold, bool error, bool shift) {
+    (void) enabled, (void) dreq, (void) threshold, (void) error, (void) shift;
+}
+static inline void adc_fifo_drain(void) {}
+static inline uint16_t adc_fifo_get_blocking(void) { return 0; }
+void adc_run(bool run);
+
+// DMA, where the channel started by the capture and the ones after it receive the channels of the recorded
+// capture, and the channel reading the sniffer gets the sum of the reference samples
+#define DREQ_ADC 36
+#define DMA_SNIFF_CTRL_CALC_VALUE_SUM 0xf
+#define EMULATED_DMA_CHANNEL_COUNT 12
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+typedef struct {
+    volatile uint32_t multi_channel_trigger;
+    volatile uint32_t ints0;
+    volatile uint32_t sniff_ctrl;
+    volatile uint32_t sniff_data;
+} dma_hw_t;
+dma_hw_t* emulated_dma_hw(void);
+#define dma_hw (emulated_dma_hw())
+static inline void dma_channel_claim(uint channel) { (void) channel; }
+static inline dma_channel_config dma_channel_get_default_config(uint channel) { (void) channel; return (dma_channel_config) { 0 }; }
+static inline void channel_config_set_transfer_data_size(dma_channel_config* config, enum dma_channel_transfer_size size) { (void) config, (void) size; }
+static inline void channel_config_set_read_increment(dma_channel_config* config, bool increment) { (void) config, (void) increment; }
+static inline void channel_config_set_write_increment(dma_channel_config* config, bool increment) { (void) config, (void) increment; }
+static inline void channel_config_set_dreq(dma_channel_config* config, uint dreq) { (void) config, (void) dreq; }
+static inline void channel_config_set_chain_to(dma_channel_config* config, uint channel) { (void) config, (void) channel; }
+static inline void channel_config_set_sniff_enable(dma_channel_config* config, bool enabled) { (void) config, (void) enabled; }
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_address,
+    const volatile void* read_address, uint transfer_count, bool trigger);
+void dma_channel_set_write_addr(uint channel, volatile void* write_address, bool trigger);
+static inline void dma_channel_set_read_addr(uint channel, const volatile void* read_address, bool trigger) {
+    (void) channel, (void) read_address, (void) trigger;
+}
+void dma_channel_start(uint channel);
+void dma_channel_set_irq0_enabled(uint channel, bool enabled);
+static inline void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+    (void) channel, (void) mode, (void) force_channel_enable;
+}
+void dma_sniffer_set_data_accumulator(uint32_t value);
+
+// Registers that are only written, or only read for timing
+typedef struct {
+    volatile uint32_t csr;
+    volatile uint32_t rvr;
+    volatile uint32_t cvr;
+    volatile uint32_t calib;
+} systick_hw_t;
+systick_hw_t* emulated_systick_hw(void);
+#define systick_hw (emulated_systick_hw())
+
+#define BUSCTRL_BUS_PRIORITY_DMA_W_BITS 0x1000u
+#define BUSCTRL_BUS_PRIORITY_DMA_R_BITS 0x100u
+typedef struct {
+    volatile uint32_t priority;
+} bus_ctrl_hw_t;
+bus_ctrl_hw_t* emulated_bus_ctrl_hw(void);
+#define bus_ctrl_hw (emulated_bus_ctrl_hw())
+
+// Software model of the interpolators, with the shift, mask, sign extension and raw add of each lane (not the
+// cross inputs and results, clamp or blend modes). The base of the full result is as wide as a pointer, as the
+// firmware adds table offsets to it
+typedef struct {
+    uint32_t accum[2];
+    uint32_t base[2];
+    uintptr_t full_base;
+    uint32_t ctrl[2];
+} interp_hw_t;
+typedef struct {
+    uint32_t ctrl;
+} interp_config;
+#define EMULATED_INTERP_SHIFT_LSB 0
+#define EMULATED_INTERP_MASK_LSB_LSB 5
+#define EMULATED_INTERP_MASK_MSB_LSB 10
+#define EMULATED_INTERP_SIGNED_BIT (1u << 15)
+#define EMULATED_INTERP_ADD_RAW_BIT (1u << 18)
+interp_hw_t* emulated_interp_hw(uint index);
+#define interp0 (emulated_interp_hw(0))
+#define interp1 (emulated_interp_hw(1))
+static inline interp_config interp_default_config(void) { return (interp_config) { 31u << EMULATED_INTERP_MASK_MSB_LSB }; }
+static inline void interp_config_set_add_raw(interp_config* config, bool add_raw) {
+    config->ctrl = (config->ctrl & ~EMULATED_INTERP_ADD_RAW_BIT) | (add_raw ? EMULATED_INTERP_ADD_RAW_BIT : 0);
+}
+static inline void interp_config_set_signed(interp_config* config, bool is_signed) {
+    config->ctrl = (config->ctrl & ~EMULATED_INTERP_SIGNED_BIT) | (is_signed ? EMULATED_INTERP_SIGNED_BIT : 0);
+}
+static inline void interp_config_set_shift(interp_config* config, uint shift) {
+    config->ctrl = (config->ctrl & ~(0x1Fu << EMULATED_INTERP_SHIFT_LSB)) | shift << EMULATED_INTERP_SHIFT_LSB;
+}
+static inline void interp_config_set_mask(interp_config* config, uint low_bit, uint high_bit) {
+    config->ctrl = (config->ctrl & ~(0x3FFu << EMULATED_INTERP_MASK_LSB_LSB))
+        | low_bit << EMULATED_INTERP_MASK_LSB_LSB | high_bit << EMULATED_INTERP_MASK_MSB_LSB;
+}
+static inline void interp_set_config(interp_hw_t* interp, uint lane, interp_config* config) { interp->ctrl[lane] = config->ctrl; }
+static inline void interp_set_accumulator(interp_hw_t* interp, uint lane, uint32_t value) { interp->accum[lane] = value; }
+void interp_set_base(interp_hw_t* interp, uint lane, uintptr_t value);
+uintptr_t interp_pop_full_result(interp_hw_t* interp);
+
+// USB, with the host never connected
+static inline bool tud_cdc_connected(void) { return false; }
+static inline uint32_t tud_vendor_write_available(void) { return 0; }
+static inline uint32_t tud_vendor_write(const void* data, uint32_t size) { (void) data, (void) size; return 0; }
+static inline uint32_t tud_vendor_write_flush(void) { return 0; }
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace lockin {
+
+// Lock-free queue between exactly one producer thread and one consumer thread. The capacity is rounded up to a
+// power of two, and one slot is always left empty to tell a full queue from an empty one
+template <typename T>
+class spsc_queue {
+public:
+    explicit spsc_queue(size_t capacity) : slots(round_up(capacity + 1)), mask(slots.size() - 1) {}
+
+    // Called by the producer only, fails if the queue is full
+    bool try_push(T&& item) {
+        size_t write = write_index.load(std::memory_order_relaxed);
+        size_t next = (write + 1) & mask;
+        if (next == read_index.load(std::memory_order_acquire)) return false;
+
+        slots[write] = std::move(item);
+        write_index.store(next, std::memory_order_release);
+
+        return true;
+    }
+
+    // Called by the consumer only, fails if the queue is empty
+    bool try_pop(T& item) {
+        size_t read = read_index.load(std::memory_order_relaxed);
+        if (read == write_index.load(std::memory_order_acquire)) return false;
+
+        item = std::move(slots[read]);
+        read_index.store((read + 1) & mask, std::memory_order_release);
+
+        return true;
+    }
+
+    bool empty() const {
+        return read_index.load(std::memory_order_acquire) == write_index.load(std::memory_order_acquire);
+    }
+
+private:
+    static size_t round_up(size_t count) {
+        size_t size = 2;
+        while (size < count) size <<= 1;
+
+        return size;
+    }
+
+    std::vector<T> slots;
+    const size_t mask;
+
+    // Each index is written by one side only, and is kept on its own cache line so the sides don't contend
+    alignas(64) std::atomic<size_t> write_index{0};
+    alignas(64) std::atomic<size_t> read_index{0};
+};
+
+}
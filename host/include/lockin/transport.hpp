@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace lockin {
+
+// USB IDs of the composite device (the defaults of usb_descriptors.c), with the console on interface 0 and the
+// binary stream on interface 2
+constexpr uint16_t usb_vendor_id = 0x1209;
+constexpr uint16_t usb_product_id = 0x0001;
+constexpr int usb_data_interface = 2;
+constexpr unsigned char usb_data_in_endpoint = 0x83;
+
+// Connection to the device (or to something that behaves like it). Every method may be called from a different
+// thread, but each one from a single thread at a time. Errors are thrown as std::runtime_error
+class transport {
+public:
+    virtual ~transport() = default;
+
+    // Text for the console, as typed on a terminal
+    virtual void write_console(const std::string& text) = 0;
+
+    // Read up to size bytes of the console or of the binary stream, waiting at most timeout_ms for the first ones.
+    // Zero means nothing arrived in time
+    virtual size_t read_console(char* buffer, size_t size, int timeout_ms) = 0;
+    virtual size_t read_data(uint8_t* buffer, size_t size, int timeout_ms) = 0;
+};
+
+// The device on the USB bus, through the CDC ACM tty of the console and usbfs for the vendor interface
+class usb_transport : public transport {
+public:
+    // Opens the first device found, or the one with the given serial number
+    explicit usb_transport(const std::string& serial = "");
+    ~usb_transport() override;
+
+    usb_transport(const usb_transport&) = delete;
+    usb_transport& operator=(const usb_transport&) = delete;
+
+    void write_console(const std::string& text) override;
+    size_t read_console(char* buffer, size_t size, int timeout_ms) override;
+    size_t read_data(uint8_t* buffer, size_t size, int timeout_ms) override;
+
+private:
+    // Bulk transfers kept queued on the data endpoint
+    struct urb_pool;
+
+    void open_device(const std::string& serial);
+    void close_device();
+
+    int console_fd = -1;
+    int usb_fd = -1;
+    std::unique_ptr<urb_pool> urbs;
+};
+
+}
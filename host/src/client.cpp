@@ -0,0 +1,203 @@
+#include "lockin/client.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+namespace lockin {
+
+namespace {
+
+constexpr int read_timeout_ms = 100;
+constexpr size_t read_chunk_size = 16384;
+// Larger payloads can only come from a corrupted header
+constexpr uint32_t max_payload_size = 1 << 24;
+// The dispatch thread sleeps this long when there is nothing queued, instead of waiting on a lock
+constexpr auto dispatch_idle_time = std::chrono::microseconds(500);
+
+const uint8_t frame_magic[] = {
+    STREAM_FRAME_MAGIC & 0xFF, (STREAM_FRAME_MAGIC >> 8) & 0xFF, (STREAM_FRAME_MAGIC >> 16) & 0xFF, STREAM_FRAME_MAGIC >> 24
+};
+
+std::optional<result> parse_result(const std::string& line) {
+    const char* position = line.c_str();
+    char* end;
+
+    result parsed;
+    parsed.time_s = std::strtod(position, &end);
+    if (end == position) return std::nullopt;
+    position = end;
+
+    while (*position != '\0') {
+        if (*position != ',') return std::nullopt;
+        position++;
+
+        double value = std::strtod(position, &end);
+        if (end == position) return std::nullopt;
+        parsed.values.push_back(value);
+        position = end;
+    }
+    if (parsed.values.empty()) return std::nullopt;
+
+    return parsed;
+}
+
+}
+
+client::client(std::unique_ptr<transport> device, size_t queue_capacity)
+    : device(std::move(device)), frames(queue_capacity), lines(queue_capacity) {}
+
+client::~client() {
+    stop();
+}
+
+void client::start() {
+    if (dispatching) return;
+
+    reading = true;
+    dispatching = true;
+    data_thread = std::thread(&client::read_data, this);
+    console_thread = std::thread(&client::read_console, this);
+    dispatch_thread = std::thread(&client::dispatch, this);
+}
+
+void client::stop() {
+    reading = false;
+    if (data_thread.joinable()) data_thread.join();
+    if (console_thread.joinable()) console_thread.join();
+
+    // Only once the readers are done, so the dispatch thread can drain the queues
+    dispatching = false;
+    if (dispatch_thread.joinable()) dispatch_thread.join();
+}
+
+void client::send(const std::string& command) {
+    device->write_console(command);
+}
+
+client_statistics client::statistics() const {
+    client_statistics statistics;
+    statistics.frames = frame_count;
+    statistics.data_bytes = data_bytes;
+    statistics.device_dropped = device_dropped;
+    statistics.host_dropped = host_dropped;
+    statistics.resyncs = resyncs;
+
+    return statistics;
+}
+
+void client::check() const {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error) std::rethrow_exception(error);
+}
+
+void client::fail(std::exception_ptr exception) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) error = exception;
+}
+
+void client::read_data() {
+    std::vector<uint8_t> stream;
+    std::vector<uint8_t> chunk(read_chunk_size);
+    bool have_last = false;
+    uint32_t last_sequence = 0, last_dropped = 0;
+
+    try {
+        while (reading) {
+            size_t count = device->read_data(chunk.data(), chunk.size(), read_timeout_ms);
+            if (count == 0) continue;
+            data_bytes += count;
+            stream.insert(stream.end(), chunk.begin(), chunk.begin() + count);
+
+            size_t start = 0;
+            while (stream.size() - start >= sizeof(stream_frame_header_t)) {
+                stream_frame_header_t header;
+                std::memcpy(&header, stream.data() + start, sizeof(header));
+
+                // Lost track of the frames, so skip to the next thing that looks like a header
+                if (header.magic != STREAM_FRAME_MAGIC || header.payload_size > max_payload_size) {
+                    auto next = std::search(stream.begin() + start + 1, stream.end(), std::begin(frame_magic), std::end(frame_magic));
+                    start = std::min<size_t>(next - stream.begin(), stream.size() - sizeof(frame_magic) + 1);
+                    resyncs++;
+                    continue;
+                }
+
+                size_t frame_size = sizeof(header) + header.payload_size;
+                if (stream.size() - start < frame_size) break;
+
+                capture_frame frame;
+                frame.header = header;
+                frame.payload.assign(stream.begin() + start + sizeof(header), stream.begin() + start + frame_size);
+                start += frame_size;
+
+                // The device counts its drops from the start of each stream, which restarts the sequence
+                bool same_stream = have_last && header.sequence > last_sequence && header.dropped_count >= last_dropped;
+                device_dropped += header.dropped_count - (same_stream ? last_dropped : 0);
+                have_last = true;
+                last_sequence = header.sequence;
+                last_dropped = header.dropped_count;
+
+                frame_count++;
+                if (!frames.try_push(std::move(frame))) host_dropped++;
+            }
+            stream.erase(stream.begin(), stream.begin() + start);
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void client::read_console() {
+    std::string line;
+    char chunk[256];
+
+    try {
+        while (reading) {
+            size_t count = device->read_console(chunk, sizeof(chunk), read_timeout_ms);
+            for (size_t i = 0; i < count; i++) {
+                if (chunk[i] == '\r') continue;
+                if (chunk[i] != '\n') {
+                    line += chunk[i];
+                    continue;
+                }
+
+                // Losing console lines is better than blocking on a full queue
+                if (!line.empty()) lines.try_push(std::move(line));
+                line.clear();
+            }
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void client::dispatch() {
+    capture_frame frame;
+    std::string line;
+
+    while (true) {
+        bool idle = true;
+
+        while (frames.try_pop(frame)) {
+            idle = false;
+            if (frame_handler) frame_handler(frame);
+        }
+
+        while (lines.try_pop(line)) {
+            idle = false;
+
+            std::optional<result> parsed = result_handler ? parse_result(line) : std::nullopt;
+            if (parsed) result_handler(*parsed);
+            else if (line_handler) line_handler(line);
+        }
+
+        if (idle) {
+            if (!dispatching) break;
+            std::this_thread::sleep_for(dispatch_idle_time);
+        }
+    }
+}
+
+}
@@ -0,0 +1,190 @@
+#include "lockin/sdk_emulation.h"
+
+// The firmware itself, with the emulated SDK. Its main is never run, as the replay only needs the processing
+#define main firmware_main
+#include "lockin-pico.c"
+#undef main
+
+bool firmware_load_flash(const uint8_t* image, size_t size) {
+    if (size > sizeof(emulated_flash)) return false;
+
+    memset(emulated_flash, 0xFF, sizeof(emulated_flash));
+    memcpy(emulated_flash, image, size);
+
+    return true;
+}
+
+bool firmware_init(void) {
+    // Like main, leaving out the clocks and USB, and without the progress and the intermediate results
+    quiet_output = true;
+
+    if (!init_adc()) return false;
+
+    load_adc_correction();
+    load_measurement_profile();
+
+    return true;
+}
+
+bool firmware_select_profile(const char* name) {
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        if (strcmp(name, measurement_profiles[p].name) != 0) continue;
+
+        measurement_profile_index = p;
+        return true;
+    }
+
+    return false;
+}
+
+const char* firmware_get_profile(void) {
+    return get_measurement_profile()->name;
+}
+
+uint32_t firmware_get_iterations(void) {
+    return get_measurement_profile()->iterations;
+}
+
+uint32_t firmware_get_profile_count(void) {
+    return PROFILE_COUNT;
+}
+
+const char* firmware_get_profile_name(uint32_t index) {
+    return index < PROFILE_COUNT ? measurement_profiles[index].name : NULL;
+}
+
+bool firmware_init_sampling(const stream_frame_header_t* header) {
+    // Planning again every time also starts the phase tracker over, so results don't depend on what ran before
+    if (!init_sampling(header->frequency_hz)) return false;
+
+    if (header->channel_count != ADC_CHANNEL_COUNT || header->capture_periods != CAPTURE_PERIODS
+        || header->period_cycles != sampling_plan.period_cycles || header->samples_per_period != sampling_plan.samples_per_period
+        || header->channel_length != adc_channel_length) {
+        printf("ERROR: THE CAPTURES WERE RECORDED WITH ANOTHER CONFIGURATION OF THE FIRMWARE!\n");
+
+        return false;
+    }
+
+    return true;
+}
+
+bool firmware_tracks_phase(void) {
+    return PHASE_TRACKING;
+}
+
+size_t firmware_get_tracker_state_size(void) {
+    return sizeof(phase_tracker);
+}
+
+void firmware_save_tracker_state(void* state) {
+    memcpy(state, &phase_tracker, sizeof(phase_tracker));
+}
+
+void firmware_restore_tracker_state(const void* state) {
+    memcpy(&phase_tracker, state, sizeof(phase_tracker));
+}
+
+void firmware_track_phase(const firmware_capture_t* captures, uint32_t count) {
+    emulation_set_captures(captures, count);
+
+    // The multiplexer channel makes no difference to the reference, so the captures go through in the same order
+    // as a measurement takes them
+    for (int i = 0; i < count; i++) {
+        capture_samples(i, count);
+        get_reference_crossing();
+    }
+}
+
+bool firmware_plan_sampling(double frequency_hz, stream_frame_header_t* header) {
+    sampling_plan_t plan;
+    if (!plan_coherent_sampling(frequency_hz, &plan)) return false;
+
+    // The same fields as fill_stream_frame takes from the plan
+    header->frequency_hz = plan.frequency_hz;
+    header->period_cycles = plan.period_cycles;
+    header->adc_period_256ths = plan.adc_period_256ths;
+    header->samples_per_period = plan.samples_per_period;
+    header->channel_count = ADC_CHANNEL_COUNT;
+    header->capture_periods = CAPTURE_PERIODS;
+    header->channel_length = plan.samples_per_period * CAPTURE_PERIODS;
+    header->pwm_wrap = plan.pwm_wrap;
+    header->second_pwm_wrap = plan.second_pwm_wrap;
+    header->pwm_divider_16ths = plan.pwm_divider_16ths;
+    header->second_pwm_divider_16ths = plan.second_pwm_divider_16ths;
+
+    return true;
+}
+
+uint32_t firmware_get_clock_frequency(void) {
+    return CLOCK_FREQ_HZ;
+}
+
+uint32_t firmware_get_dut_position_count(void) {
+    return DUT_POSITION_COUNT;
+}
+
+uint32_t firmware_get_measurement_captures(uint32_t iterations) {
+    return iterations * MUX_CHANNEL_COUNT;
+}
+
+uint32_t firmware_get_voltage_count(void) {
+    return DUT_POSITION_COUNT * get_voltage_count();
+}
+
+bool firmware_measure(const firmware_capture_t* captures, uint32_t iterations, double* voltages, double* temperature_c) {
+    emulation_set_captures(captures, firmware_get_measurement_captures(iterations));
+
+    double complex* measured_voltages = measure_voltages(iterations);
+    if (measured_voltages == NULL) return false;
+
+    for (int i = 0; i < firmware_get_voltage_count(); i++) {
+        voltages[2 * i] = creal(measured_voltages[i]);
+        voltages[2 * i + 1] = cimag(measured_voltages[i]);
+    }
+    free(measured_voltages);
+
+    *temperature_c = get_temperature();
+
+    return true;
+}
+
+uint32_t firmware_find_zero_crossing(const firmware_capture_t* capture) {
+    emulation_set_captures(capture, 1);
+    capture_samples(0, 1);
+
+    return find_zero_crossing(get_reference_average());
+}
+
+uint32_t firmware_get_correlation_count(void) {
+    return DUT_COUNT * DEMODULATED_COUNT;
+}
+
+bool firmware_correlate(const firmware_capture_t* capture, bool interpolator, int64_t* sines, int64_t* cosines) {
+    emulation_set_captures(capture, 1);
+    capture_samples(0, 1);
+
+    uint crossing = find_zero_crossing(get_reference_average());
+    if (crossing == -1) return false;
+
+    int64_t sine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+    int64_t cosine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+    demodulate_harmonics(interpolator ? KERNEL_INTERPOLATOR : KERNEL_TABLE, crossing >> CROSSING_FRACTION_BITS,
+        sine_accumulators, cosine_accumulators);
+
+    memcpy(sines, sine_accumulators, sizeof(sine_accumulators));
+    memcpy(cosines, cosine_accumulators, sizeof(cosine_accumulators));
+
+    return true;
+}
+
+double firmware_get_voltage_frequency(uint32_t index) {
+    return get_voltage_frequency(index % get_voltage_count());
+}
+
+double firmware_get_component_value(const double* open_voltage, const double* dut_voltage, char component,
+    double frequency_hz) {
+    // The recording has no calibration temperature, so the calibration is taken as it is
+    double complex result = calculate_result(open_voltage[0] + open_voltage[1] * I, dut_voltage[0] + dut_voltage[1] * I, 0);
+
+    return get_component_value(result, component, frequency_hz);
+}
@@ -0,0 +1,308 @@
+#include "lockin/mock_device.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "lockin/firmware.h"
+
+namespace lockin {
+
+namespace {
+
+constexpr int poll_interval_ms = 1;
+
+// Like the firmware, the stream reports its throughput every second, relative to the full speed bulk limit
+constexpr auto stream_report_interval = std::chrono::seconds(1);
+constexpr double full_speed_bulk_bytes_per_s = 19 * 64 * 1000;
+
+// Code of the temperature sensor at 27 C, read after every capture like the firmware does
+constexpr uint16_t temperature_code = 876;
+
+}
+
+mock_device::mock_device(const mock_settings& settings)
+    : settings(settings), plan_header(), boot_time(clock::now()), random(settings.seed) {
+    // The plan and capture layout come from the firmware itself, so they follow its configuration
+    if (!firmware_plan_sampling(settings.frequency_hz, &plan_header)) {
+        throw std::runtime_error("No coherent sampling plan for the mock frequency");
+    }
+
+    plan_header.magic = STREAM_FRAME_MAGIC;
+    plan_header.payload_size = plan_header.channel_count * plan_header.channel_length * sizeof(uint16_t);
+    plan_header.temperature_code = temperature_code;
+
+    // The mock boots with the profile the firmware has selected on this thread, as it would load it from the flash
+    for (uint32_t p = 0; p < firmware_get_profile_count(); p++) {
+        if (std::strcmp(firmware_get_profile_name(p), firmware_get_profile()) == 0) profile_index = p;
+    }
+
+    print(std::string("Measurement profile: ") + firmware_get_profile_name(profile_index) + "\n");
+    print("\n-------------------------------------------------\n");
+    print_prompt();
+}
+
+void mock_device::print(const std::string& text) {
+    console_output += text;
+}
+
+void mock_device::print_prompt() {
+    print("Set up every DUT as open circuit and press Enter (or B to run the benchmark, L to calibrate the ADC, "
+        "N to characterize the noise floor of the measurement profiles, P to select the measurement profile, D to dump the log, S to stream captures, U to test the stream throughput, "
+        "M to monitor the voltages)...\n");
+}
+
+void mock_device::add_frame(uint32_t type, clock::time_point start) {
+    // The firmware only has two frames, and drops the capture if neither is free
+    if (frames.size() >= 2) {
+        if (type == STREAM_FRAME_CAPTURE) dropped_count++;
+        sequence++;
+
+        return;
+    }
+
+    stream_frame_header_t header = plan_header;
+    header.type = type;
+    header.sequence = sequence++;
+    header.dropped_count = dropped_count;
+    header.start_us = std::chrono::duration_cast<std::chrono::microseconds>(start - boot_time).count();
+
+    // Time of the capture start in system clock cycles, which sets where the PWM counters were
+    uint64_t start_cycles = std::llround(header.start_us * (firmware_get_clock_frequency() / 1e6));
+    header.start_pwm_count = (start_cycles % header.period_cycles) * 16 / header.pwm_divider_16ths;
+    if (header.second_pwm_divider_16ths != 0) {
+        uint64_t second_period_cycles = (uint64_t) (header.second_pwm_wrap + 1) * header.second_pwm_divider_16ths / 16;
+        header.start_second_pwm_count = (start_cycles % second_period_cycles) * 16 / header.second_pwm_divider_16ths;
+    }
+
+    std::vector<uint8_t> frame(sizeof(header) + header.payload_size);
+    std::memcpy(frame.data(), &header, sizeof(header));
+
+    if (type == STREAM_FRAME_CAPTURE) {
+        std::normal_distribution<double> noise(0, settings.noise_codes);
+        uint16_t* samples = reinterpret_cast<uint16_t*>(frame.data() + sizeof(header));
+
+        // The round robin converts one channel after the other, so each one is sampled a conversion later. The
+        // plan is coherent, so a period holds exactly channel_count * samples_per_period conversions
+        double start_phase = 2 * M_PI * (start_cycles % header.period_cycles) / header.period_cycles;
+        uint32_t period_conversions = header.channel_count * header.samples_per_period;
+        for (uint32_t i = 0; i < header.channel_length; i++) {
+            for (uint16_t c = 0; c < header.channel_count; c++) {
+                double value;
+                uint32_t conversion = (i * header.channel_count + c) % period_conversions;
+                double phase = start_phase + 2 * M_PI * conversion / period_conversions;
+
+                if (c == 0) {
+                    value = 2048 + settings.reference_amplitude * std::sin(phase) + noise(random);
+                } else {
+                    value = 2048 + settings.dut_amplitude * std::sin(phase + settings.dut_phase_deg * M_PI / 180) + noise(random);
+                }
+
+                samples[c * header.channel_length + i] = std::clamp<long>(std::lround(value), 0, 4095);
+            }
+        }
+    } else {
+        uint32_t* words = reinterpret_cast<uint32_t*>(frame.data() + sizeof(header));
+        uint32_t word_count = header.payload_size / sizeof(uint32_t);
+        for (uint32_t i = 0; i < word_count; i++) {
+            words[i] = header.sequence * word_count + i;
+        }
+    }
+
+    frames.push_back(std::move(frame));
+}
+
+void mock_device::update(clock::time_point now) {
+    auto capture_duration = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(plan_header.capture_periods / plan_header.frequency_hz));
+
+    char line[128];
+    if (current_mode == mode::capture_stream) {
+        while (next_capture <= now) {
+            add_frame(STREAM_FRAME_CAPTURE, next_capture);
+            next_capture += capture_duration;
+        }
+    } else if (current_mode == mode::test_stream) {
+        while (frames.size() < 2) add_frame(STREAM_FRAME_TEST, now);
+    } else if (current_mode == mode::monitor) {
+        // Before the calibration the monitor reports the voltage of every DUT position, which the firmware gives
+        // at twice the amplitude of the input
+        std::normal_distribution<double> noise(0, settings.monitor_noise);
+        double phase = settings.dut_phase_deg * M_PI / 180;
+        while (next_monitor <= now) {
+            std::snprintf(line, sizeof(line), "%.6lf", std::chrono::duration<double>(next_monitor - monitor_start).count());
+            print(line);
+            for (uint32_t d = 0; d < firmware_get_dut_position_count(); d++) {
+                double amplitude = 2 * settings.dut_amplitude * (1 + noise(random));
+                std::snprintf(line, sizeof(line), ", %lf, %lf", amplitude * std::cos(phase), amplitude * std::sin(phase));
+                print(line);
+            }
+            print("\n");
+
+            monitor_count++;
+            next_monitor += std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(settings.monitor_period_s));
+        }
+    }
+
+    if ((current_mode == mode::capture_stream || current_mode == mode::test_stream) && now - report_time >= stream_report_interval) {
+        double bytes_per_s = (sent_bytes - report_sent_bytes) / std::chrono::duration<double>(now - report_time).count();
+        std::snprintf(line, sizeof(line), "Streaming %8.1lf kB/s (%5.1lf%% of the full speed limit), %u frames, %u dropped\n",
+            bytes_per_s / 1000, 100 * bytes_per_s / full_speed_bulk_bytes_per_s, sequence, dropped_count);
+        print(line);
+
+        report_time = now;
+        report_sent_bytes = sent_bytes;
+    }
+
+    // Bytes the link could have carried since the last read, without saving up more than a few packets while idle
+    link_credit += std::chrono::duration<double>(now - link_time).count() * settings.link_bytes_per_s;
+    link_credit = std::min(link_credit, 4096.0);
+    link_time = now;
+}
+
+void mock_device::write_console(const std::string& text) {
+    std::lock_guard<std::mutex> lock(mutex);
+    clock::time_point now = clock::now();
+    update(now);
+
+    char line[256];
+    for (char command : text) {
+        // The number of the profile comes right after P, and anything else keeps the current one
+        if (selecting_profile) {
+            selecting_profile = false;
+            if (command >= '1' && static_cast<uint32_t>(command - '1') < firmware_get_profile_count()) profile_index = command - '1';
+
+            std::snprintf(line, sizeof(line), "Using the %s profile\n", firmware_get_profile_name(profile_index));
+            print(line);
+            print("\n");
+            print_prompt();
+            continue;
+        }
+
+        command = std::toupper(static_cast<unsigned char>(command));
+
+        // Q stops whatever runs, and is otherwise ignored like the other commands the mock doesn't have
+        if (current_mode != mode::idle) {
+            if (command != 'Q') continue;
+
+            if (current_mode == mode::monitor) {
+                std::snprintf(line, sizeof(line), "Schedule jitter: %.1lf us RMS, %lld us max, %u overruns in %u measurements\n",
+                    0.0, 0LL, 0u, monitor_count);
+                print(line);
+            } else {
+                double seconds = std::chrono::duration<double>(now - stream_start).count();
+                std::snprintf(line, sizeof(line), "Streamed %.1lf kB/s on average, %u frames, %u dropped\n",
+                    seconds > 0 ? sent_bytes / seconds / 1000 : 0, sequence, dropped_count);
+                print(line);
+            }
+
+            // The frame going out is finished like the firmware does, and the one waiting after it is lost
+            current_mode = mode::idle;
+            if (frame_offset == 0) frames.clear();
+            else frames.resize(1);
+        } else if (command == 'S' || command == 'U') {
+            // The rest of a frame from the last stream may still be going out, ahead of the new ones
+            current_mode = command == 'S' ? mode::capture_stream : mode::test_stream;
+            sequence = 0;
+            dropped_count = 0;
+            next_capture = now;
+            stream_start = now;
+            report_time = now;
+            sent_bytes = 0;
+            report_sent_bytes = 0;
+
+            std::snprintf(line, sizeof(line), "\nStreaming %s frames of %zu bytes on the data interface (press Q to stop)...\n",
+                command == 'S' ? "capture" : "test", sizeof(stream_frame_header_t) + plan_header.payload_size);
+            print(line);
+            continue;
+        } else if (command == 'M') {
+            current_mode = mode::monitor;
+            monitor_start = now;
+            next_monitor = now;
+            monitor_count = 0;
+
+            std::snprintf(line, sizeof(line), "\nTiming a measurement with the %s profile...\n", firmware_get_profile_name(profile_index));
+            print(line);
+            std::snprintf(line, sizeof(line), "Measuring every %.3lf s (press Q to stop)...\n", settings.monitor_period_s);
+            print(line);
+            print("Time (s), voltage (real, imaginary, in ADC units) of every DUT position\n");
+            continue;
+        } else if (command == 'P') {
+            print("\n");
+            for (uint32_t p = 0; p < firmware_get_profile_count(); p++) {
+                std::snprintf(line, sizeof(line), "%c %u: %s\n", p == profile_index ? '*' : ' ', p + 1, firmware_get_profile_name(p));
+                print(line);
+            }
+            print("Input the number of the profile to use (or anything else to keep the current one)...\n");
+
+            selecting_profile = true;
+            continue;
+        } else if (command == 'D') {
+            print("\nSequence, time since boot (s), frequency (Hz), temperature (C), voltages (real, imaginary) of every DUT position\n");
+            print("0 records\n");
+        } else if (command != 'Q') {
+            continue;
+        }
+
+        print("\n");
+        print_prompt();
+    }
+}
+
+size_t mock_device::read_console(char* buffer, size_t size, int timeout_ms) {
+    clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            update(clock::now());
+
+            if (!console_output.empty()) {
+                size_t count = std::min(size, console_output.size());
+                std::memcpy(buffer, console_output.data(), count);
+                console_output.erase(0, count);
+
+                return count;
+            }
+        }
+
+        if (clock::now() >= deadline) return 0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
+    }
+}
+
+size_t mock_device::read_data(uint8_t* buffer, size_t size, int timeout_ms) {
+    clock::time_point deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            update(clock::now());
+
+            size_t count = 0;
+            while (count < size && !frames.empty() && link_credit >= 1) {
+                std::vector<uint8_t>& frame = frames.front();
+                size_t length = std::min({ size - count, frame.size() - frame_offset, static_cast<size_t>(link_credit) });
+                std::memcpy(buffer + count, frame.data() + frame_offset, length);
+
+                count += length;
+                frame_offset += length;
+                sent_bytes += length;
+                link_credit -= length;
+                if (frame_offset == frame.size()) {
+                    frames.pop_front();
+                    frame_offset = 0;
+                }
+            }
+            if (count > 0) return count;
+        }
+
+        if (clock::now() >= deadline) return 0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
+    }
+}
+
+}
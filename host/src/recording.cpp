@@ -0,0 +1,306 @@
+#include "lockin/recording.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace lockin {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string& message) {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+}
+
+size_t padded(size_t size) {
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+}
+
+recording_writer::recording_writer(const std::string& path, const recording_info& info, size_t chunk_size,
+    int64_t chunk_us, size_t index_interval)
+    : header(), chunk_size(chunk_size), chunk_us(chunk_us), index_interval(index_interval), current_chunk() {
+    if (info.calibration.size() > max_calibration_values) throw std::runtime_error("Too many calibration values");
+
+    std::memcpy(header.magic, recording_magic, sizeof(header.magic));
+    header.version = recording_version;
+    header.header_size = sizeof(recording_header);
+    header.created_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    header.frequency_hz = info.frequency_hz;
+    std::strncpy(header.profile, info.profile.c_str(), sizeof(header.profile) - 1);
+    header.calibration_count = info.calibration.size();
+    for (size_t i = 0; i < info.calibration.size(); i++) {
+        header.calibration[2 * i] = info.calibration[i].real();
+        header.calibration[2 * i + 1] = info.calibration[i].imag();
+    }
+
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw_errno("Can't create " + path);
+
+    // The header is written with pwrite, which doesn't move the file offset the chunks are appended at
+    write_header();
+    file_offset = header.header_size;
+    if (lseek(fd, file_offset, SEEK_SET) < 0) throw_errno("Can't write the recording");
+    chunk.reserve(chunk_size + sizeof(record_header));
+}
+
+recording_writer::~recording_writer() {
+    try {
+        close();
+    } catch (...) {
+        // Nothing to report the error to, the recording can still be read without its trailer
+    }
+}
+
+void recording_writer::write(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    size_t written = 0;
+    while (written < size) {
+        ssize_t count = ::write(fd, bytes + written, size - written);
+        if (count < 0 && errno != EINTR) throw_errno("Can't write the recording");
+        if (count > 0) written += count;
+    }
+    file_offset += size;
+}
+
+void recording_writer::write_header() {
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) throw_errno("Can't write the recording header");
+}
+
+void recording_writer::set_frequency(double frequency_hz) {
+    header.frequency_hz = frequency_hz;
+    write_header();
+}
+
+void recording_writer::append(int64_t timestamp_us, record_type type, const void* data, size_t size) {
+    // The index needs the timestamps in order, so a clock that steps back doesn't get to move them back
+    timestamp_us = std::max(timestamp_us, last_timestamp_us);
+    last_timestamp_us = timestamp_us;
+
+    if (current_chunk.record_count == 0) current_chunk.first_us = timestamp_us;
+    current_chunk.last_us = timestamp_us;
+    current_chunk.record_count++;
+
+    record_header record = { timestamp_us, type, static_cast<uint32_t>(size) };
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    chunk.insert(chunk.end(), reinterpret_cast<const uint8_t*>(&record), reinterpret_cast<const uint8_t*>(&record + 1));
+    chunk.insert(chunk.end(), bytes, bytes + size);
+    chunk.resize(padded(chunk.size()));
+
+    if (chunk.size() >= chunk_size || timestamp_us - current_chunk.first_us >= chunk_us) flush_chunk();
+}
+
+void recording_writer::flush_chunk() {
+    if (current_chunk.record_count == 0) return;
+
+    pending_index.push_back({ current_chunk.first_us, file_offset });
+
+    current_chunk.magic = chunk_magic;
+    current_chunk.type = chunk_records;
+    current_chunk.payload_size = chunk.size();
+    write(&current_chunk, sizeof(current_chunk));
+    write(chunk.data(), chunk.size());
+
+    chunk.clear();
+    current_chunk = chunk_header();
+
+    if (pending_index.size() >= index_interval) flush_index();
+}
+
+void recording_writer::flush_index() {
+    if (pending_index.empty()) return;
+
+    chunk_header index_chunk = {};
+    index_chunk.magic = chunk_magic;
+    index_chunk.type = chunk_index;
+    index_chunk.record_count = pending_index.size();
+    index_chunk.payload_size = sizeof(uint64_t) + pending_index.size() * sizeof(index_entry);
+
+    uint64_t index_offset = file_offset;
+    write(&index_chunk, sizeof(index_chunk));
+    write(&last_index_offset, sizeof(last_index_offset));
+    write(pending_index.data(), pending_index.size() * sizeof(index_entry));
+
+    last_index_offset = index_offset;
+    pending_index.clear();
+}
+
+void recording_writer::close() {
+    if (fd < 0) return;
+
+    flush_chunk();
+    flush_index();
+
+    recording_trailer trailer = { last_index_offset, trailer_magic, 0 };
+    write(&trailer, sizeof(trailer));
+
+    ::close(fd);
+    fd = -1;
+}
+
+recording_reader::recording_reader(const std::string& path) {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw_errno("Can't open " + path);
+
+    struct stat status;
+    if (fstat(fd, &status) < 0) throw_errno("Can't read the size of " + path);
+    size = status.st_size;
+
+    if (size < sizeof(recording_header)) {
+        ::close(fd);
+        throw std::runtime_error(path + " is too short to be a recording");
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        throw_errno("Can't map " + path);
+    }
+    base = static_cast<const uint8_t*>(mapping);
+
+    // Records are read in order, so let the kernel read ahead
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    try {
+        if (std::memcmp(header().magic, recording_magic, sizeof(recording_magic)) != 0
+            || header().version != recording_version || header().header_size < sizeof(recording_header)) {
+            throw std::runtime_error(path + " isn't a recording of a supported version");
+        }
+
+        load_index();
+    } catch (...) {
+        munmap(mapping, size);
+        ::close(fd);
+        throw;
+    }
+}
+
+recording_reader::~recording_reader() {
+    munmap(const_cast<uint8_t*>(base), size);
+    ::close(fd);
+}
+
+recording_info recording_reader::info() const {
+    recording_info info;
+    info.frequency_hz = header().frequency_hz;
+    info.profile = std::string(header().profile, strnlen(header().profile, sizeof(header().profile)));
+    for (uint32_t i = 0; i < header().calibration_count && i < max_calibration_values; i++) {
+        info.calibration.emplace_back(header().calibration[2 * i], header().calibration[2 * i + 1]);
+    }
+
+    return info;
+}
+
+const chunk_header* recording_reader::chunk_at(size_t position) const {
+    if (position + sizeof(chunk_header) > size) return nullptr;
+
+    const chunk_header* chunk = reinterpret_cast<const chunk_header*>(base + position);
+    if (chunk->magic != chunk_magic || position + sizeof(chunk_header) + chunk->payload_size > size) return nullptr;
+
+    return chunk;
+}
+
+void recording_reader::load_index() {
+    const recording_trailer* trailer = reinterpret_cast<const recording_trailer*>(base + size - sizeof(recording_trailer));
+    has_trailer = size >= header().header_size + sizeof(recording_trailer) && trailer->magic == trailer_magic;
+    if (!has_trailer) {
+        scan_chunks();
+        return;
+    }
+
+    // The index chunks link back to each other, from the last one. Each one was written after the one it links
+    // to, so the offsets only go down, and its entries have to fit in its payload
+    std::vector<std::vector<index_entry>> blocks;
+    for (uint64_t offset = trailer->last_index_offset; offset != 0;) {
+        const chunk_header* chunk = chunk_at(offset);
+        if (chunk == nullptr || chunk->type != chunk_index || chunk->payload_size < sizeof(uint64_t)
+            || chunk->record_count > (chunk->payload_size - sizeof(uint64_t)) / sizeof(index_entry)) {
+            throw std::runtime_error("Corrupted recording index");
+        }
+
+        const uint8_t* payload = reinterpret_cast<const uint8_t*>(chunk + 1);
+        const index_entry* entries = reinterpret_cast<const index_entry*>(payload + sizeof(uint64_t));
+        blocks.emplace_back(entries, entries + chunk->record_count);
+
+        uint64_t previous_offset;
+        std::memcpy(&previous_offset, payload, sizeof(previous_offset));
+        if (previous_offset >= offset) throw std::runtime_error("Corrupted recording index");
+        offset = previous_offset;
+    }
+
+    for (auto block = blocks.rbegin(); block != blocks.rend(); block++) {
+        index.insert(index.end(), block->begin(), block->end());
+    }
+}
+
+void recording_reader::scan_chunks() {
+    // Stops at the first chunk that was cut short
+    for (size_t position = header().header_size; const chunk_header* chunk = chunk_at(position);) {
+        if (chunk->type == chunk_records) index.push_back({ chunk->first_us, position });
+        position += sizeof(chunk_header) + chunk->payload_size;
+    }
+}
+
+recording_reader::cursor recording_reader::begin() const {
+    cursor start;
+    start.reader = this;
+
+    return start;
+}
+
+recording_reader::cursor recording_reader::seek(int64_t timestamp_us) const {
+    cursor position = begin();
+
+    // The last chunk starting at or before the timestamp, as the record may be in the middle of it
+    auto after = std::upper_bound(index.begin(), index.end(), timestamp_us,
+        [](int64_t timestamp, const index_entry& entry) { return timestamp < entry.first_us; });
+    position.chunk = after == index.begin() ? 0 : after - index.begin() - 1;
+
+    // Then go through that chunk until the record, without taking it
+    record_view record;
+    for (cursor previous = position; position.next(record); previous = position) {
+        if (record.timestamp_us >= timestamp_us) return previous;
+    }
+
+    return position;
+}
+
+bool recording_reader::cursor::next(record_view& record) {
+    while (chunk < reader->index.size()) {
+        // The index may come from the file, so the chunk and every record in it have to be where it says
+        const chunk_header* header = reader->chunk_at(reader->index[chunk].offset);
+        if (header == nullptr || header->type != chunk_records) throw std::runtime_error("Corrupted recording chunk");
+
+        if (offset + sizeof(record_header) <= header->payload_size) {
+            const uint8_t* payload = reinterpret_cast<const uint8_t*>(header + 1);
+            const record_header* stored = reinterpret_cast<const record_header*>(payload + offset);
+            if (stored->size > header->payload_size - offset - sizeof(record_header)) {
+                throw std::runtime_error("Corrupted recording chunk");
+            }
+
+            record.timestamp_us = stored->timestamp_us;
+            record.type = static_cast<record_type>(stored->type);
+            record.data = reinterpret_cast<const uint8_t*>(stored + 1);
+            record.size = stored->size;
+            offset += sizeof(record_header) + padded(stored->size);
+
+            return true;
+        }
+
+        chunk++;
+        offset = 0;
+    }
+
+    return false;
+}
+
+}
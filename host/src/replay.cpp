@@ -0,0 +1,235 @@
+#include "lockin/replay.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "lockin/firmware.h"
+#include "lockin/recording.hpp"
+
+namespace lockin {
+
+namespace {
+
+// Consecutive captures of a recording with the same sampling plan
+struct capture_run {
+    std::vector<firmware_capture_t> captures;
+    std::vector<int64_t> timestamps_us;
+};
+
+// Measurements replayed in a row by one thread, starting from the phase tracker state the ones before left
+struct replay_task {
+    size_t file;
+    const capture_run* run;
+    size_t first_capture;
+    size_t first_measurement;
+    unsigned measurement_count;
+    std::vector<uint8_t> tracker_state;
+};
+
+// Tasks of a capture run, one after the other
+struct run_tasks {
+    size_t file;
+    const capture_run* run;
+    size_t first_task;
+    size_t task_count;
+};
+
+bool same_plan(const stream_frame_header_t& a, const stream_frame_header_t& b) {
+    return a.frequency_hz == b.frequency_hz && a.period_cycles == b.period_cycles
+        && a.adc_period_256ths == b.adc_period_256ths && a.samples_per_period == b.samples_per_period
+        && a.channel_count == b.channel_count && a.capture_periods == b.capture_periods
+        && a.channel_length == b.channel_length && a.pwm_wrap == b.pwm_wrap && a.second_pwm_wrap == b.second_pwm_wrap;
+}
+
+// Calls function with every index below count, spread over the threads, and rethrows the first error
+template <typename function_t>
+void run_parallel(size_t count, unsigned threads, function_t function) {
+    std::atomic<size_t> next{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto worker = [&]() {
+        try {
+            for (size_t i = next++; i < count; i = next++) function(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < std::min<size_t>(threads, count); t++) workers.emplace_back(worker);
+    for (std::thread& thread : workers) thread.join();
+
+    if (error) std::rethrow_exception(error);
+}
+
+void init_firmware_thread() {
+    thread_local bool initialized = false;
+    if (initialized) return;
+
+    if (!firmware_init()) throw std::runtime_error("Can't set up the firmware");
+    initialized = true;
+}
+
+std::vector<capture_run> scan_captures(const recording_reader& reader, replay_file& file) {
+    std::vector<capture_run> runs;
+    const stream_frame_header_t* last_header = nullptr;
+
+    record_view record;
+    for (recording_reader::cursor cursor = reader.begin(); cursor.next(record);) {
+        if (record.type != record_frame || record.size < sizeof(stream_frame_header_t)) continue;
+
+        // The records are 8 byte aligned in the mapping, so the frames can be used where they are
+        const stream_frame_header_t* header = reinterpret_cast<const stream_frame_header_t*>(record.data);
+        size_t payload_size = (size_t) header->channel_count * header->channel_length * sizeof(uint16_t);
+        if (header->type != STREAM_FRAME_CAPTURE || header->payload_size != payload_size
+            || record.size != sizeof(stream_frame_header_t) + payload_size) {
+            continue;
+        }
+
+        if (last_header == nullptr || !same_plan(*header, *last_header)) runs.emplace_back();
+        last_header = header;
+
+        const uint16_t* samples = reinterpret_cast<const uint16_t*>(record.data + sizeof(stream_frame_header_t));
+        runs.back().captures.push_back({ header, samples });
+        runs.back().timestamps_us.push_back(record.timestamp_us);
+
+        file.captures++;
+        file.capture_bytes += record.size;
+    }
+
+    return runs;
+}
+
+}
+
+void load_flash_image(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) throw std::runtime_error("Can't open " + path);
+
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    if (!firmware_load_flash(image.data(), image.size())) throw std::runtime_error(path + " is larger than the flash");
+}
+
+std::vector<replay_file> replay(const std::vector<std::string>& paths, const replay_settings& settings) {
+    unsigned threads = settings.threads != 0 ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // The profile the firmware boots with, for recordings that don't name theirs
+    init_firmware_thread();
+    const std::string default_profile = firmware_get_profile();
+
+    std::vector<std::unique_ptr<recording_reader>> readers;
+    std::vector<replay_file> files(paths.size());
+    for (size_t f = 0; f < paths.size(); f++) {
+        readers.push_back(std::make_unique<recording_reader>(paths[f]));
+        files[f].path = paths[f];
+
+        files[f].profile = readers[f]->info().profile;
+        if (files[f].profile.empty()) files[f].profile = default_profile;
+        if (!firmware_select_profile(files[f].profile.c_str())) {
+            throw std::runtime_error(paths[f] + " was measured with the profile " + files[f].profile + ", which the firmware doesn't have");
+        }
+        files[f].iterations = settings.iterations != 0 ? settings.iterations : firmware_get_iterations();
+    }
+
+    std::vector<std::vector<capture_run>> runs(paths.size());
+    run_parallel(paths.size(), threads, [&](size_t f) { runs[f] = scan_captures(*readers[f], files[f]); });
+
+    // Split every run into whole measurements, and those into tasks
+    std::vector<replay_task> tasks;
+    std::vector<run_tasks> run_task_ranges;
+    for (size_t f = 0; f < files.size(); f++) {
+        size_t measurement_captures = firmware_get_measurement_captures(files[f].iterations);
+
+        for (const capture_run& run : runs[f]) {
+            size_t run_measurements = run.captures.size() / measurement_captures;
+
+            run_task_ranges.push_back({ f, &run, tasks.size(), 0 });
+            for (size_t m = 0; m < run_measurements; m += settings.task_measurements) {
+                unsigned count = std::min<size_t>(settings.task_measurements, run_measurements - m);
+                tasks.push_back({ f, &run, m * measurement_captures, files[f].measurements.size() + m, count, {} });
+            }
+            run_task_ranges.back().task_count = tasks.size() - run_task_ranges.back().first_task;
+            files[f].measurements.resize(files[f].measurements.size() + run_measurements);
+        }
+    }
+
+    // The phase tracker runs alone and in order over each run first, skipping the demodulation, so the tasks can
+    // then start from where it was and measure in parallel exactly as the device would in a row
+    if (firmware_tracks_phase()) {
+        run_parallel(run_task_ranges.size(), threads, [&](size_t r) {
+            const run_tasks& range = run_task_ranges[r];
+            const replay_file& file = files[range.file];
+
+            init_firmware_thread();
+            firmware_select_profile(file.profile.c_str());
+            if (!firmware_init_sampling(range.run->captures[0].header)) {
+                throw std::runtime_error(file.path + " was recorded with another configuration of the firmware");
+            }
+
+            size_t measurement_captures = firmware_get_measurement_captures(file.iterations);
+            for (size_t t = range.first_task; t < range.first_task + range.task_count; t++) {
+                replay_task& task = tasks[t];
+                task.tracker_state.resize(firmware_get_tracker_state_size());
+                firmware_save_tracker_state(task.tracker_state.data());
+                firmware_track_phase(&range.run->captures[task.first_capture], task.measurement_count * measurement_captures);
+            }
+        });
+    }
+
+    std::vector<std::vector<std::complex<double>>> calibrations;
+    for (const std::unique_ptr<recording_reader>& reader : readers) calibrations.push_back(reader->info().calibration);
+
+    // Every task writes to its own measurements, so the results need no locking
+    run_parallel(tasks.size(), threads, [&](size_t t) {
+        const replay_task& task = tasks[t];
+        replay_file& file = files[task.file];
+        const std::vector<std::complex<double>>& calibration = calibrations[task.file];
+
+        init_firmware_thread();
+        firmware_select_profile(file.profile.c_str());
+        if (!firmware_init_sampling(task.run->captures[task.first_capture].header)) {
+            throw std::runtime_error(file.path + " was recorded with another configuration of the firmware");
+        }
+        if (!task.tracker_state.empty()) firmware_restore_tracker_state(task.tracker_state.data());
+
+        // The demodulator of the profile sets how many voltages there are
+        uint32_t voltage_count = firmware_get_voltage_count();
+        size_t measurement_captures = firmware_get_measurement_captures(file.iterations);
+        std::vector<double> voltages(2 * voltage_count);
+        for (unsigned m = 0; m < task.measurement_count; m++) {
+            size_t first_capture = task.first_capture + m * measurement_captures;
+            replay_measurement& measurement = file.measurements[task.first_measurement + m];
+
+            if (!firmware_measure(&task.run->captures[first_capture], file.iterations, voltages.data(), &measurement.temperature_c)) {
+                throw std::runtime_error("Can't replay the measurements of " + file.path);
+            }
+
+            measurement.timestamp_us = task.run->timestamps_us[first_capture];
+            measurement.time_s = task.run->captures[first_capture].header->start_us / 1e6;
+            for (uint32_t v = 0; v < voltage_count; v++) {
+                measurement.voltages.emplace_back(voltages[2 * v], voltages[2 * v + 1]);
+                measurement.frequencies_hz.push_back(firmware_get_voltage_frequency(v));
+
+                // std::complex<double> is laid out as its real and imaginary parts
+                if (calibration.size() != voltage_count) continue;
+                measurement.values.push_back(firmware_get_component_value(reinterpret_cast<const double*>(&calibration[v]),
+                    &voltages[2 * v], settings.component, measurement.frequencies_hz[v]));
+            }
+        }
+    });
+
+    return files;
+}
+
+}
@@ -0,0 +1,254 @@
+#include "lockin/sdk_emulation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t emulated_flash[PICO_FLASH_SIZE_BYTES];
+char __flash_binary_end;
+
+// Hardware of the calling thread
+typedef struct {
+    adc_hw_t adc;
+    dma_hw_t dma;
+    systick_hw_t systick;
+    bus_ctrl_hw_t bus_ctrl;
+    interp_hw_t interp[2];
+
+    volatile void* dma_write_addresses[EMULATED_DMA_CHANNEL_COUNT];
+    const volatile void* dma_read_addresses[EMULATED_DMA_CHANNEL_COUNT];
+    uint32_t dma_irq0_mask;
+    uint32_t sniffer_accumulator;
+    uint round_robin_channel;
+    uint adc_input;
+
+    void (*dma_irq_handler)(void);
+    bool dma_irq_enabled;
+
+    uint16_t pwm_wraps[8];
+
+    const firmware_capture_t* captures;
+    uint capture_count;
+    uint next_capture;
+    // Capture started by the DMA and not yet delivered by the ADC, and the last one started
+    const firmware_capture_t* pending_capture;
+    const firmware_capture_t* current_capture;
+} emulated_hardware_t;
+
+static _Thread_local emulated_hardware_t hardware;
+
+__attribute__((constructor)) static void erase_emulated_flash(void) {
+    memset(emulated_flash, 0xFF, sizeof(emulated_flash));
+}
+
+void flash_range_erase(uint32_t offset, size_t count) {
+    memset(emulated_flash + offset, 0xFF, count);
+}
+
+void flash_range_program(uint32_t offset, const uint8_t* data, size_t count) {
+    memcpy(emulated_flash + offset, data, count);
+}
+
+void emulation_set_captures(const firmware_capture_t* captures, uint count) {
+    hardware.captures = captures;
+    hardware.capture_count = count;
+    hardware.next_capture = 0;
+}
+
+uint64_t time_us_64(void) {
+    return hardware.current_capture != NULL ? hardware.current_capture->header->start_us : 0;
+}
+
+void queue_init(queue_t* queue, uint element_size, uint element_count) {
+    queue->data = calloc(element_count, element_size);
+    queue->element_size = element_size;
+    queue->element_count = element_count;
+    queue->head = 0;
+    queue->count = 0;
+}
+
+bool queue_try_add(queue_t* queue, const void* element) {
+    if (queue->count == queue->element_count) return false;
+
+    uint index = (queue->head + queue->count) % queue->element_count;
+    memcpy(queue->data + index * queue->element_size, element, queue->element_size);
+    queue->count++;
+
+    return true;
+}
+
+bool queue_try_remove(queue_t* queue, void* element) {
+    if (queue->count == 0) return false;
+
+    memcpy(element, queue->data + queue->head * queue->element_size, queue->element_size);
+    queue->head = (queue->head + 1) % queue->element_count;
+    queue->count--;
+
+    return true;
+}
+
+void irq_set_exclusive_handler(uint irq, void (*handler)(void)) {
+    if (irq == DMA_IRQ_0) hardware.dma_irq_handler = handler;
+}
+
+void irq_set_enabled(uint irq, bool enabled) {
+    if (irq == DMA_IRQ_0) hardware.dma_irq_enabled = enabled;
+}
+
+bool irq_is_enabled(uint irq) {
+    return irq == DMA_IRQ_0 && hardware.dma_irq_enabled;
+}
+
+void pwm_set_wrap(uint slice, uint16_t wrap) {
+    hardware.pwm_wraps[slice] = wrap;
+}
+
+uint16_t pwm_get_counter(uint slice) {
+    const firmware_capture_t* capture = hardware.current_capture;
+    if (capture == NULL) return 0;
+
+    // The slices are told apart by their wrap, as the firmware sets up each tone with the wrap of its plan
+    const stream_frame_header_t* header = capture->header;
+    bool second_tone = header->second_pwm_wrap != header->pwm_wrap && hardware.pwm_wraps[slice] == header->second_pwm_wrap;
+
+    return second_tone ? header->start_second_pwm_count : header->start_pwm_count;
+}
+
+void adc_init(void) {
+    // Conversions complete as soon as they start
+    hardware.adc.cs = ADC_CS_READY_BITS;
+}
+
+void adc_select_input(uint input) {
+    hardware.adc_input = input;
+}
+
+uint16_t adc_read(void) {
+    const firmware_capture_t* capture = hardware.current_capture;
+    if (capture == NULL || hardware.adc_input != ADC_TEMPERATURE_CHANNEL_NUM) return 0;
+
+    return capture->header->temperature_code;
+}
+
+adc_hw_t* emulated_adc_hw(void) {
+    return &hardware.adc;
+}
+
+dma_hw_t* emulated_dma_hw(void) {
+    return &hardware.dma;
+}
+
+systick_hw_t* emulated_systick_hw(void) {
+    return &hardware.systick;
+}
+
+bus_ctrl_hw_t* emulated_bus_ctrl_hw(void) {
+    return &hardware.bus_ctrl;
+}
+
+interp_hw_t* emulated_interp_hw(uint index) {
+    return &hardware.interp[index];
+}
+
+void interp_set_base(interp_hw_t* interp, uint lane, uintptr_t value) {
+    if (lane == 2) interp->full_base = value;
+    else interp->base[lane] = value;
+}
+
+// Accumulator of a lane shifted right, masked and optionally sign extended from the top bit of the mask
+static uint32_t get_interp_lane_value(const interp_hw_t* interp, uint lane) {
+    uint32_t ctrl = interp->ctrl[lane];
+    uint shift = (ctrl >> EMULATED_INTERP_SHIFT_LSB) & 0x1F;
+    uint low_bit = (ctrl >> EMULATED_INTERP_MASK_LSB_LSB) & 0x1F;
+    uint high_bit = (ctrl >> EMULATED_INTERP_MASK_MSB_LSB) & 0x1F;
+
+    uint32_t mask = (high_bit == 31 ? ~0u : (1u << (high_bit + 1)) - 1) & ~((1u << low_bit) - 1);
+    uint32_t value = (interp->accum[lane] >> shift) & mask;
+    if ((ctrl & EMULATED_INTERP_SIGNED_BIT) && high_bit < 31 && (value >> high_bit & 1)) value |= ~0u << (high_bit + 1);
+
+    return value;
+}
+
+uintptr_t interp_pop_full_result(interp_hw_t* interp) {
+    uint32_t lane_values[2] = { get_interp_lane_value(interp, 0), get_interp_lane_value(interp, 1) };
+
+    // The full result adds the shifted and masked lanes to the third base, and popping it writes the result of
+    // each lane (its base plus either the raw accumulator or the shifted and masked one) back to its accumulator
+    uintptr_t full_result = interp->full_base + lane_values[0] + lane_values[1];
+    for (int lane = 0; lane < 2; lane++) {
+        bool add_raw = interp->ctrl[lane] & EMULATED_INTERP_ADD_RAW_BIT;
+        interp->accum[lane] = interp->base[lane] + (add_raw ? interp->accum[lane] : lane_values[lane]);
+    }
+
+    return full_result;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_address,
+    const volatile void* read_address, uint transfer_count, bool trigger) {
+    (void) config, (void) transfer_count, (void) trigger;
+
+    hardware.dma_write_addresses[channel] = write_address;
+    hardware.dma_read_addresses[channel] = read_address;
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void* write_address, bool trigger) {
+    (void) trigger;
+
+    hardware.dma_write_addresses[channel] = write_address;
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled) {
+    if (enabled) hardware.dma_irq0_mask |= 1u << channel;
+    else hardware.dma_irq0_mask &= ~(1u << channel);
+}
+
+void dma_sniffer_set_data_accumulator(uint32_t value) {
+    hardware.sniffer_accumulator = value;
+}
+
+void dma_channel_start(uint channel) {
+    // The started channel takes the first channel of the capture, and the ones after it the rest
+    if (hardware.next_capture == hardware.capture_count) {
+        printf("ERROR: THE FIRMWARE STARTED MORE CAPTURES THAN WERE RECORDED!\n");
+        abort();
+    }
+
+    hardware.round_robin_channel = channel;
+    hardware.pending_capture = &hardware.captures[hardware.next_capture++];
+    hardware.current_capture = hardware.pending_capture;
+}
+
+void adc_run(bool run) {
+    const firmware_capture_t* capture = hardware.pending_capture;
+    if (!run || capture == NULL) return;
+    hardware.pending_capture = NULL;
+
+    // Every channel of the round robin goes to its own DMA channel, and the sniffer adds up the reference
+    const stream_frame_header_t* header = capture->header;
+    for (uint c = 0; c < header->channel_count; c++) {
+        uint channel = hardware.round_robin_channel + c;
+        const uint16_t* samples = capture->samples + c * header->channel_length;
+
+        if (channel >= EMULATED_DMA_CHANNEL_COUNT || hardware.dma_write_addresses[channel] == NULL) {
+            printf("ERROR: NO DMA CHANNEL SET UP FOR CAPTURE CHANNEL %u!\n", c);
+            abort();
+        }
+        memcpy((void*) hardware.dma_write_addresses[channel], samples, header->channel_length * sizeof(uint16_t));
+
+        if (c != 0) continue;
+        for (uint i = 0; i < header->channel_length; i++) {
+            hardware.sniffer_accumulator += samples[i];
+        }
+    }
+    hardware.dma.sniff_data = hardware.sniffer_accumulator;
+
+    // The done channel copies the sniffer sum and raises the interrupt that ends the capture
+    for (uint channel = 0; channel < EMULATED_DMA_CHANNEL_COUNT; channel++) {
+        if (hardware.dma_read_addresses[channel] != &hardware.dma.sniff_data) continue;
+
+        *(volatile uint32_t*) hardware.dma_write_addresses[channel] = hardware.dma.sniff_data;
+        if ((hardware.dma_irq0_mask & (1u << channel)) && hardware.dma_irq_enabled && hardware.dma_irq_handler != NULL) {
+            hardware.dma_irq_handler();
+        }
+    }
+}
@@ -0,0 +1,220 @@
+#include "lockin/transport.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace lockin {
+
+namespace {
+
+// Every transfer is a single packet, so each one completes as soon as the device sends anything and no data
+// waits in a half filled transfer. Enough of them are queued to keep the bus busy between reaps
+constexpr size_t urb_size = 64;
+constexpr size_t urb_count = 64;
+
+[[noreturn]] void throw_errno(const std::string& message) {
+    throw std::runtime_error(message + ": " + std::strerror(errno));
+}
+
+std::string read_attribute(const std::string& path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+
+    return value;
+}
+
+std::vector<std::string> list_directory(const std::string& path) {
+    std::vector<std::string> entries;
+
+    DIR* directory = opendir(path.c_str());
+    if (directory == nullptr) return entries;
+    while (dirent* entry = readdir(directory)) {
+        if (entry->d_name[0] != '.') entries.push_back(entry->d_name);
+    }
+    closedir(directory);
+
+    return entries;
+}
+
+// Sysfs directory of the device, like /sys/bus/usb/devices/1-1.2
+std::string find_device(const std::string& serial) {
+    const std::string devices = "/sys/bus/usb/devices/";
+
+    char vendor_id[5], product_id[5];
+    std::snprintf(vendor_id, sizeof(vendor_id), "%04x", usb_vendor_id);
+    std::snprintf(product_id, sizeof(product_id), "%04x", usb_product_id);
+
+    for (const std::string& name : list_directory(devices)) {
+        std::string path = devices + name;
+        if (read_attribute(path + "/idVendor") != vendor_id) continue;
+        if (read_attribute(path + "/idProduct") != product_id) continue;
+        if (!serial.empty() && read_attribute(path + "/serial") != serial) continue;
+
+        return path;
+    }
+
+    throw std::runtime_error("No lock-in Pico found on USB" + (serial.empty() ? "" : " with serial " + serial));
+}
+
+}
+
+struct usb_transport::urb_pool {
+    usbdevfs_urb urbs[urb_count];
+    uint8_t buffers[urb_count][urb_size];
+
+    // Data of the last reaped transfer that didn't fit in the reader's buffer
+    usbdevfs_urb* partial = nullptr;
+    size_t partial_offset = 0;
+};
+
+usb_transport::usb_transport(const std::string& serial) : urbs(new urb_pool()) {
+    // The destructor doesn't run if the constructor throws, so undo whatever was opened
+    try {
+        open_device(serial);
+    } catch (...) {
+        close_device();
+        throw;
+    }
+}
+
+usb_transport::~usb_transport() {
+    close_device();
+}
+
+void usb_transport::open_device(const std::string& serial) {
+    std::string device = find_device(serial);
+    std::string name = device.substr(device.find_last_of('/') + 1);
+
+    // The console is the tty of the CDC interface
+    std::vector<std::string> ttys = list_directory(device + "/" + name + ":1.0/tty");
+    if (ttys.empty()) throw std::runtime_error("The console of " + name + " has no tty");
+
+    std::string tty = "/dev/" + ttys[0];
+    console_fd = open(tty.c_str(), O_RDWR | O_NOCTTY);
+    if (console_fd < 0) throw_errno("Can't open " + tty);
+
+    // Raw bytes, without echo or line editing. Opening it raises DTR, which the firmware waits for
+    termios settings;
+    if (tcgetattr(console_fd, &settings) < 0) throw_errno("Can't read the settings of " + tty);
+    cfmakeraw(&settings);
+    if (tcsetattr(console_fd, TCSANOW, &settings) < 0) throw_errno("Can't set up " + tty);
+
+    char usbfs_path[64];
+    std::snprintf(usbfs_path, sizeof(usbfs_path), "/dev/bus/usb/%03d/%03d",
+        std::stoi(read_attribute(device + "/busnum")), std::stoi(read_attribute(device + "/devnum")));
+    usb_fd = open(usbfs_path, O_RDWR);
+    if (usb_fd < 0) throw_errno(std::string("Can't open ") + usbfs_path);
+
+    int interface = usb_data_interface;
+    if (ioctl(usb_fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) throw_errno("Can't claim the data interface");
+
+    for (size_t i = 0; i < urb_count; i++) {
+        usbdevfs_urb& urb = urbs->urbs[i];
+        urb = {};
+        urb.type = USBDEVFS_URB_TYPE_BULK;
+        urb.endpoint = usb_data_in_endpoint;
+        urb.buffer = urbs->buffers[i];
+        urb.buffer_length = urb_size;
+        if (ioctl(usb_fd, USBDEVFS_SUBMITURB, &urb) < 0) throw_errno("Can't queue a transfer on the data endpoint");
+    }
+}
+
+void usb_transport::close_device() {
+    if (usb_fd >= 0) {
+        // Cancel the queued transfers, which still have to be reaped before closing
+        for (usbdevfs_urb& urb : urbs->urbs) {
+            ioctl(usb_fd, USBDEVFS_DISCARDURB, &urb);
+        }
+        usbdevfs_urb* urb;
+        while (ioctl(usb_fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+        }
+
+        int interface = usb_data_interface;
+        ioctl(usb_fd, USBDEVFS_RELEASEINTERFACE, &interface);
+        close(usb_fd);
+        usb_fd = -1;
+    }
+
+    if (console_fd >= 0) {
+        close(console_fd);
+        console_fd = -1;
+    }
+}
+
+void usb_transport::write_console(const std::string& text) {
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t count = write(console_fd, text.data() + written, text.size() - written);
+        if (count < 0 && errno != EINTR) throw_errno("Can't write to the console");
+        if (count > 0) written += count;
+    }
+}
+
+size_t usb_transport::read_console(char* buffer, size_t size, int timeout_ms) {
+    pollfd request = { console_fd, POLLIN, 0 };
+    int ready = poll(&request, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR) throw_errno("Can't wait for the console");
+    if (ready <= 0) return 0;
+
+    ssize_t count = read(console_fd, buffer, size);
+    if (count < 0 && errno != EINTR && errno != EAGAIN) throw_errno("Can't read the console");
+
+    return count > 0 ? count : 0;
+}
+
+size_t usb_transport::read_data(uint8_t* buffer, size_t size, int timeout_ms) {
+    size_t count = 0;
+    while (count < size) {
+        // Finish the transfer that didn't fit last time before taking any other
+        usbdevfs_urb* urb = urbs->partial;
+        if (urb == nullptr) {
+            if (ioctl(usb_fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+                if (errno != EAGAIN) throw_errno("Can't reap a transfer of the data endpoint");
+
+                // Only wait while nothing has been read yet, usbfs signals completed transfers as writable
+                if (count > 0) break;
+                pollfd request = { usb_fd, POLLOUT, 0 };
+                int ready = poll(&request, 1, timeout_ms);
+                if (ready < 0 && errno != EINTR) throw_errno("Can't wait for the data endpoint");
+                if (ready <= 0) break;
+                continue;
+            }
+            if (urb->status < 0 && urb->status != -EREMOTEIO) {
+                errno = -urb->status;
+                throw_errno("Transfer of the data endpoint failed");
+            }
+            urbs->partial_offset = 0;
+        }
+
+        size_t length = std::min<size_t>(urb->actual_length - urbs->partial_offset, size - count);
+        std::memcpy(buffer + count, static_cast<uint8_t*>(urb->buffer) + urbs->partial_offset, length);
+        count += length;
+        urbs->partial_offset += length;
+
+        // Queue the transfer again once all of its data is out
+        urbs->partial = urbs->partial_offset < static_cast<size_t>(urb->actual_length) ? urb : nullptr;
+        if (urbs->partial == nullptr) {
+            urb->actual_length = 0;
+            urb->status = 0;
+            if (ioctl(usb_fd, USBDEVFS_SUBMITURB, urb) < 0) throw_errno("Can't queue a transfer on the data endpoint");
+        }
+    }
+
+    return count;
+}
+
+}
@@ -0,0 +1,206 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lockin/client.hpp"
+#include "lockin/firmware.h"
+#include "lockin/mock_device.hpp"
+
+// Runs the client against the mock device through the commands the tools send, one after the other like a session
+// with the firmware: the capture stream, the monitor and the test stream, each stopped with Q, and the profile selection
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* message) {
+    if (condition) return;
+
+    std::printf("FAILED: %s\n", message);
+    failures++;
+}
+
+// What the callbacks saw, handed over from the dispatch thread
+struct session {
+    std::mutex mutex;
+    std::vector<lockin::capture_frame> frames;
+    std::vector<lockin::result> results;
+    std::vector<std::string> lines;
+
+    bool has_line(const char* start) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::string& line : lines) {
+            if (line.compare(0, std::strlen(start), start) == 0) return true;
+        }
+
+        return false;
+    }
+
+    size_t line_count(const char* start) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = 0;
+        for (const std::string& line : lines) count += line.compare(0, std::strlen(start), start) == 0;
+
+        return count;
+    }
+};
+
+// Sends a command, lets it run, and stops it
+void run_command(lockin::client& client, const char* command, int milliseconds) {
+    client.send(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    client.send("Q");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    client.check();
+}
+
+void check_capture_frames(const std::vector<lockin::capture_frame>& frames, const stream_frame_header_t& plan) {
+    check(frames.size() > 10, "the capture stream sends frames");
+
+    bool valid = true, ordered = true;
+    for (size_t f = 0; f < frames.size(); f++) {
+        const stream_frame_header_t& header = frames[f].header;
+        valid &= header.magic == STREAM_FRAME_MAGIC && header.frequency_hz == plan.frequency_hz
+            && header.channel_count == plan.channel_count && header.channel_length == plan.channel_length
+            && header.payload_size == header.channel_count * header.channel_length * sizeof(uint16_t)
+            && frames[f].payload.size() == header.payload_size && header.start_pwm_count <= header.pwm_wrap;
+        if (f > 0) ordered &= header.sequence > frames[f - 1].header.sequence && header.start_us > frames[f - 1].header.start_us;
+
+        // The reference and the DUT input swing around the middle of the range
+        for (unsigned c = 0; c < header.channel_count && valid; c++) {
+            const uint16_t* samples = frames[f].channel(c);
+            for (uint32_t i = 0; i < header.channel_length; i++) valid &= samples[i] > 0 && samples[i] < 4095;
+        }
+    }
+    check(valid, "the capture frames have the plan of the firmware and valid samples");
+    check(ordered, "the capture frames come in order");
+}
+
+void check_test_frames(const std::vector<lockin::capture_frame>& frames) {
+    check(frames.size() > 10, "the test stream sends frames");
+
+    // Every test frame counts on from the last word of the one before
+    bool counting = true;
+    for (const lockin::capture_frame& frame : frames) {
+        const uint32_t* words = reinterpret_cast<const uint32_t*>(frame.payload.data());
+        uint32_t word_count = frame.header.payload_size / sizeof(uint32_t);
+        for (uint32_t i = 0; i < word_count; i++) counting &= words[i] == frame.header.sequence * word_count + i;
+    }
+    check(counting, "the test frames hold the counting words");
+}
+
+void check_results(const std::vector<lockin::result>& results, const lockin::mock_settings& settings) {
+    check(results.size() >= 3, "the monitor reports results");
+
+    // Uncalibrated, so the real and imaginary voltage of every DUT position
+    double phase = settings.dut_phase_deg * M_PI / 180;
+    bool valid = true;
+    for (size_t r = 0; r < results.size(); r++) {
+        const lockin::result& result = results[r];
+        valid &= result.values.size() == 2 * firmware_get_dut_position_count();
+        if (r > 0) valid &= result.time_s > results[r - 1].time_s;
+
+        for (size_t v = 0; v + 1 < result.values.size(); v += 2) {
+            valid &= std::abs(result.values[v] - 2 * settings.dut_amplitude * std::cos(phase)) < 1;
+            valid &= std::abs(result.values[v + 1] - 2 * settings.dut_amplitude * std::sin(phase)) < 1;
+        }
+    }
+    check(valid, "the monitor results are the voltages of every DUT position");
+}
+
+}
+
+int main() {
+    lockin::mock_settings settings;
+    settings.monitor_period_s = 0.05;
+
+    // Another profile than the one the firmware boots with, which the mock has to report
+    firmware_select_profile(firmware_get_profile_name(0));
+
+    try {
+        std::unique_ptr<lockin::mock_device> mock = std::make_unique<lockin::mock_device>(settings);
+        const stream_frame_header_t plan = mock->plan();
+
+        session seen;
+        lockin::client client(std::move(mock));
+        client.on_frame([&](const lockin::capture_frame& frame) {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            seen.frames.push_back(frame);
+        });
+        client.on_result([&](const lockin::result& result) {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            seen.results.push_back(result);
+        });
+        client.on_console_line([&](const std::string& line) {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            seen.lines.push_back(line);
+        });
+        client.start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        check(seen.line_count("Set up every DUT as open circuit") == 1, "the mock boots to the first prompt");
+        std::string boot_profile = std::string("Measurement profile: ") + firmware_get_profile();
+        check(seen.has_line(boot_profile.c_str()), "the mock boots with the profile of the firmware");
+
+        run_command(client, "S", 700);
+        {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            check_capture_frames(seen.frames, plan);
+            seen.frames.clear();
+        }
+        check(seen.has_line("Streamed ") && seen.has_line("Streaming "), "the capture stream reports its throughput");
+        check(seen.line_count("Set up every DUT as open circuit") == 2, "the capture stream returns to the prompt");
+
+        // Commands sent after a stream stopped still work, as they do at every prompt of the firmware
+        run_command(client, "M", 300);
+        {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            check_results(seen.results, settings);
+            check(seen.frames.empty(), "the monitor sends no frames");
+        }
+        check(seen.has_line("Schedule jitter: "), "the monitor reports its jitter when stopped");
+        {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            char jitter_end[64];
+            std::snprintf(jitter_end, sizeof(jitter_end), "in %zu measurements", seen.results.size());
+
+            bool found = false;
+            for (const std::string& line : seen.lines) {
+                found |= line.size() >= std::strlen(jitter_end)
+                    && line.compare(line.size() - std::strlen(jitter_end), std::string::npos, jitter_end) == 0;
+            }
+            check(found, "the jitter report counts every monitor result");
+        }
+
+        run_command(client, "U", 500);
+        {
+            std::lock_guard<std::mutex> lock(seen.mutex);
+            check_test_frames(seen.frames);
+        }
+        check(seen.line_count("Set up every DUT as open circuit") == 4, "every command returns to the prompt");
+
+        // The host selects a profile by its number, right after P
+        client.send("P1");
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        client.check();
+        std::string selected = std::string("Using the ") + firmware_get_profile_name(0) + " profile";
+        check(seen.has_line(selected.c_str()), "the profile is selected by its number");
+        check(seen.line_count("Set up every DUT as open circuit") == 5, "the profile selection returns to the prompt");
+
+        client.stop();
+        client.check();
+    } catch (const std::exception& exception) {
+        std::printf("FAILED: %s\n", exception.what());
+        return 1;
+    }
+
+    if (failures == 0) std::printf("All client checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
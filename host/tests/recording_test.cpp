@@ -0,0 +1,162 @@
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lockin/recording.hpp"
+
+// Writes recordings, reads them back, and checks that corrupted ones are refused instead of read out of bounds
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* message) {
+    if (condition) return;
+
+    std::printf("FAILED: %s\n", message);
+    failures++;
+}
+
+std::vector<uint8_t> read_file(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::vector<uint8_t>& bytes) {
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+template <typename value_t>
+void poke(std::vector<uint8_t>& bytes, size_t offset, value_t value) {
+    std::memcpy(bytes.data() + offset, &value, sizeof(value));
+}
+
+template <typename value_t>
+value_t peek(const std::vector<uint8_t>& bytes, size_t offset) {
+    value_t value;
+    std::memcpy(&value, bytes.data() + offset, sizeof(value));
+    return value;
+}
+
+// Small chunks and index blocks, so that the recording has several of each
+void write_recording(const std::string& path, int record_count) {
+    lockin::recording_info info;
+    info.frequency_hz = 500;
+    info.profile = "normal";
+    info.calibration = { { 1, 2 }, { 3, 4 } };
+
+    lockin::recording_writer writer(path, info, 256, 1000000, 4);
+    for (int r = 0; r < record_count; r++) {
+        std::vector<uint8_t> data(1 + r % 40, static_cast<uint8_t>(r));
+        writer.append(1000 * r, lockin::record_frame, data.data(), data.size());
+    }
+    writer.close();
+}
+
+// Reads every record, checking them against what write_recording wrote
+int read_records(const std::string& path) {
+    lockin::recording_reader reader(path);
+
+    int count = 0;
+    lockin::record_view record;
+    for (lockin::recording_reader::cursor cursor = reader.begin(); cursor.next(record); count++) {
+        bool expected = record.timestamp_us == 1000 * count && record.size == size_t(1 + count % 40)
+            && record.data[0] == static_cast<uint8_t>(count) && record.data[record.size - 1] == static_cast<uint8_t>(count);
+        if (!expected) throw std::logic_error("Record " + std::to_string(count) + " was read back wrong");
+    }
+
+    return count;
+}
+
+bool throws(const std::function<void()>& function) {
+    try {
+        function();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+
+    return false;
+}
+
+}
+
+int main() {
+    char path_template[] = "/tmp/recording_test_XXXXXX";
+    int fd = mkstemp(path_template);
+    if (fd < 0) {
+        std::printf("FAILED: can't create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+    const std::string path = path_template;
+
+    const int record_count = 200;
+    write_recording(path, record_count);
+    const std::vector<uint8_t> original = read_file(path);
+
+    {
+        lockin::recording_reader reader(path);
+        check(reader.complete(), "the closed recording has its trailer");
+        check(reader.chunk_count() > 8, "the recording has several chunks");
+        check(reader.info().profile == "normal" && reader.info().calibration.size() == 2, "the header is read back");
+
+        lockin::record_view record;
+        lockin::recording_reader::cursor cursor = reader.seek(150000);
+        check(cursor.next(record) && record.timestamp_us == 150000, "seeking finds the record");
+    }
+    check(read_records(path) == record_count, "every record is read back");
+
+    // Without the trailer the chunks are scanned instead, as after a recording that didn't finish
+    std::vector<uint8_t> bytes = original;
+    bytes.resize(bytes.size() - sizeof(lockin::recording_trailer));
+    write_file(path, bytes);
+    check(!lockin::recording_reader(path).complete(), "the recording without trailer isn't complete");
+    check(read_records(path) == record_count, "every record is read back without the index");
+
+    // An index chunk claiming more entries than its payload holds
+    size_t last_index = peek<uint64_t>(original, original.size() - sizeof(lockin::recording_trailer));
+    bytes = original;
+    poke<uint32_t>(bytes, last_index + offsetof(lockin::chunk_header, record_count), 1000000);
+    write_file(path, bytes);
+    check(throws([&]() { lockin::recording_reader reader(path); }), "an index larger than its chunk is refused");
+
+    // An index chunk linking to itself
+    bytes = original;
+    poke<uint64_t>(bytes, last_index + sizeof(lockin::chunk_header), last_index);
+    write_file(path, bytes);
+    check(throws([&]() { lockin::recording_reader reader(path); }), "an index loop is refused");
+
+    // An index entry pointing at the index chunk instead of a record chunk
+    bytes = original;
+    poke<uint64_t>(bytes, last_index + sizeof(lockin::chunk_header) + sizeof(uint64_t) + offsetof(lockin::index_entry, offset),
+        last_index);
+    write_file(path, bytes);
+    check(throws([&]() { read_records(path); }), "an index entry to another kind of chunk is refused");
+
+    // A record larger than what's left of its chunk, with and without the index
+    size_t first_record = sizeof(lockin::recording_header) + sizeof(lockin::chunk_header);
+    bytes = original;
+    poke<uint32_t>(bytes, first_record + offsetof(lockin::record_header, size), 0xFFFFFFF0);
+    write_file(path, bytes);
+    check(throws([&]() { read_records(path); }), "a record past the end of its chunk is refused");
+
+    bytes.resize(bytes.size() - sizeof(lockin::recording_trailer));
+    write_file(path, bytes);
+    check(throws([&]() { read_records(path); }), "a record past the end of its chunk is refused when scanning");
+
+    std::remove(path.c_str());
+
+    if (failures == 0) std::printf("All recording checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
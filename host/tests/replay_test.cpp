@@ -0,0 +1,200 @@
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lockin/firmware.h"
+#include "lockin/recording.hpp"
+#include "lockin/replay.hpp"
+
+// Runs the firmware processing over synthetic captures: a clean sine to check the voltages it measures and the
+// interpolator kernel against the table one, references it can't find a crossing in, which it has to skip instead
+// of failing, and a noisy recording, whose replay can't depend on how the measurements are spread over threads
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* message) {
+    if (condition) return;
+
+    std::printf("FAILED: %s\n", message);
+    failures++;
+}
+
+// Captures of the firmware plan for the frequency, back to back, with the sample values the generator gives for
+// each channel at each phase of the excitation
+struct capture_set {
+    std::vector<stream_frame_header_t> headers;
+    std::vector<std::vector<uint16_t>> samples;
+    std::vector<firmware_capture_t> captures;
+};
+
+template <typename generator_t>
+capture_set make_captures(double frequency_hz, unsigned count, generator_t generator) {
+    stream_frame_header_t plan = {};
+    firmware_plan_sampling(frequency_hz, &plan);
+    plan.magic = STREAM_FRAME_MAGIC;
+    plan.type = STREAM_FRAME_CAPTURE;
+    plan.payload_size = plan.channel_count * plan.channel_length * sizeof(uint16_t);
+
+    capture_set set;
+    double capture_us = plan.capture_periods / plan.frequency_hz * 1e6;
+    uint32_t period_conversions = plan.channel_count * plan.samples_per_period;
+    for (unsigned k = 0; k < count; k++) {
+        stream_frame_header_t header = plan;
+        header.sequence = k;
+        header.start_us = std::llround(k * capture_us);
+
+        // Where in the period the capture starts, which the PWM counter gives the firmware
+        uint64_t start_cycles = std::llround(header.start_us * (firmware_get_clock_frequency() / 1e6));
+        header.start_pwm_count = (start_cycles % header.period_cycles) * 16 / header.pwm_divider_16ths;
+        double start_phase = 2 * M_PI * (start_cycles % header.period_cycles) / header.period_cycles;
+
+        // The round robin converts one channel after the other, a conversion apart
+        std::vector<uint16_t> samples(header.channel_count * header.channel_length);
+        for (uint32_t i = 0; i < header.channel_length; i++) {
+            for (uint16_t c = 0; c < header.channel_count; c++) {
+                uint32_t conversion = (i * header.channel_count + c) % period_conversions;
+                samples[c * header.channel_length + i] = generator(c, start_phase + 2 * M_PI * conversion / period_conversions);
+            }
+        }
+
+        set.headers.push_back(header);
+        set.samples.push_back(std::move(samples));
+    }
+
+    for (unsigned k = 0; k < count; k++) set.captures.push_back({ &set.headers[k], set.samples[k].data() });
+
+    return set;
+}
+
+void write_recording(const std::string& path, const capture_set& set) {
+    lockin::recording_info info;
+    info.frequency_hz = set.headers[0].frequency_hz;
+    info.profile = firmware_get_profile();
+
+    lockin::recording_writer writer(path, info);
+    for (size_t k = 0; k < set.captures.size(); k++) {
+        std::vector<uint8_t> record(sizeof(stream_frame_header_t) + set.headers[k].payload_size);
+        std::memcpy(record.data(), &set.headers[k], sizeof(stream_frame_header_t));
+        std::memcpy(record.data() + sizeof(stream_frame_header_t), set.samples[k].data(), set.headers[k].payload_size);
+        writer.append(set.headers[k].start_us, lockin::record_frame, record.data(), record.size());
+    }
+    writer.close();
+}
+
+// Voltages of every measurement of the recording, replayed with the given measurements per task
+std::vector<std::complex<double>> replay_voltages(const std::string& path, uint32_t iterations, unsigned task_measurements) {
+    lockin::replay_settings settings;
+    settings.iterations = iterations;
+    settings.threads = 4;
+    settings.task_measurements = task_measurements;
+
+    std::vector<lockin::replay_file> files = lockin::replay({ path }, settings);
+    std::vector<std::complex<double>> voltages;
+    for (const lockin::replay_measurement& measurement : files[0].measurements) {
+        voltages.insert(voltages.end(), measurement.voltages.begin(), measurement.voltages.end());
+    }
+
+    return voltages;
+}
+
+}
+
+int main() {
+    if (!firmware_init() || !firmware_select_profile("normal")) {
+        std::printf("FAILED: can't set up the firmware\n");
+        return 1;
+    }
+
+    const uint32_t iterations = 8;
+    const double frequency_hz = 500;
+    const double dut_amplitude = 500, dut_phase = -30 * M_PI / 180;
+    uint32_t capture_count = firmware_get_measurement_captures(iterations);
+
+    capture_set sine = make_captures(frequency_hz, capture_count, [&](uint16_t channel, double phase) {
+        double value = channel == 0 ? 2048 + 1000 * std::sin(phase) : 2048 + dut_amplitude * std::sin(phase + dut_phase);
+        return static_cast<uint16_t>(std::lround(value));
+    });
+    check(firmware_init_sampling(sine.captures[0].header), "the firmware plans the sampling of its own captures");
+    check(firmware_find_zero_crossing(&sine.captures[0]) != UINT32_MAX, "a clean sine has a zero crossing");
+
+    // The firmware gives the voltages at twice the input amplitude, relative to the reference
+    std::vector<double> voltages(2 * firmware_get_voltage_count());
+    double temperature_c;
+    check(firmware_measure(sine.captures.data(), iterations, voltages.data(), &temperature_c), "a clean sine is measured");
+    check(std::abs(voltages[0] - 2 * dut_amplitude * std::cos(dut_phase)) < 20
+        && std::abs(voltages[1] - 2 * dut_amplitude * std::sin(dut_phase)) < 20, "the fundamental of a clean sine is right");
+
+    // The interpolator kernel rounds the phase to its table, so it only agrees with the tables to within a fraction
+    // of the fundamental. The harmonics of a clean sine are about zero with both
+    std::vector<int64_t> table_sines(firmware_get_correlation_count()), table_cosines(firmware_get_correlation_count());
+    std::vector<int64_t> interpolated_sines(firmware_get_correlation_count()), interpolated_cosines(firmware_get_correlation_count());
+    check(firmware_correlate(&sine.captures[0], false, table_sines.data(), table_cosines.data())
+        && firmware_correlate(&sine.captures[0], true, interpolated_sines.data(), interpolated_cosines.data()),
+        "both kernels correlate a clean sine");
+    double fundamental = std::hypot(double(table_sines[0]), double(table_cosines[0]));
+    bool kernels_agree = fundamental > 0;
+    for (size_t c = 0; c < table_sines.size(); c++) {
+        kernels_agree &= std::abs(double(interpolated_sines[c] - table_sines[c])) < 1e-4 * fundamental
+            && std::abs(double(interpolated_cosines[c] - table_cosines[c])) < 1e-4 * fundamental;
+    }
+    check(kernels_agree, "the interpolator kernel agrees with the table one");
+
+    // A reference stuck at 0 averages 0, so every sample is both under the hysteresis band and at the average
+    capture_set flat = make_captures(frequency_hz, capture_count, [&](uint16_t channel, double phase) {
+        return static_cast<uint16_t>(channel == 0 ? 0 : std::lround(2048 + dut_amplitude * std::sin(phase)));
+    });
+    firmware_init_sampling(flat.captures[0].header);
+    check(firmware_find_zero_crossing(&flat.captures[0]) == UINT32_MAX, "a flat reference has no zero crossing");
+    bool measured = firmware_measure(flat.captures.data(), iterations, voltages.data(), &temperature_c);
+    check(!measured || (voltages[0] == 0 && voltages[1] == 0), "a flat reference gives no voltage");
+
+    // Same with the reference stuck at the top of the range
+    capture_set saturated = make_captures(frequency_hz, capture_count, [&](uint16_t channel, double phase) {
+        return static_cast<uint16_t>(channel == 0 ? 4095 : std::lround(2048 + dut_amplitude * std::sin(phase)));
+    });
+    firmware_init_sampling(saturated.captures[0].header);
+    check(firmware_find_zero_crossing(&saturated.captures[0]) == UINT32_MAX, "a saturated reference has no zero crossing");
+    measured = firmware_measure(saturated.captures.data(), iterations, voltages.data(), &temperature_c);
+    check(!measured || (voltages[0] == 0 && voltages[1] == 0), "a saturated reference gives no voltage");
+
+    // The phase tracker carries over from one measurement to the next, so it has to be the same whether the next
+    // one runs on the same thread or not
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise(0, 20);
+    capture_set noisy = make_captures(frequency_hz, 8 * capture_count, [&](uint16_t channel, double phase) {
+        double value = channel == 0 ? 2048 + 1000 * std::sin(phase) : 2048 + dut_amplitude * std::sin(phase + dut_phase);
+        return static_cast<uint16_t>(std::lround(value + noise(random)));
+    });
+
+    char path_template[] = "/tmp/replay_test_XXXXXX";
+    int fd = mkstemp(path_template);
+    if (fd < 0) {
+        std::printf("FAILED: can't create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    try {
+        write_recording(path_template, noisy);
+        std::vector<std::complex<double>> in_a_row = replay_voltages(path_template, iterations, 8);
+        std::vector<std::complex<double>> apart = replay_voltages(path_template, iterations, 1);
+        check(in_a_row.size() == 8 * firmware_get_voltage_count() && in_a_row == apart,
+            "the replay gives the same voltages however the measurements are split");
+    } catch (const std::exception& exception) {
+        std::printf("FAILED: %s\n", exception.what());
+        failures++;
+    }
+    std::remove(path_template);
+
+    if (failures == 0) std::printf("All replay checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
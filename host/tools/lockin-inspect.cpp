@@ -0,0 +1,92 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include "lockin-stream.h"
+#include "lockin/recording.hpp"
+
+// Prints the header and a summary of a recording, or the records from a given time on
+
+void print_usage() {
+    std::printf("Usage: lockin-inspect [--seek SECONDS] [--count COUNT] RECORDING\n");
+}
+
+void print_record(const lockin::record_view& record, int64_t start_us) {
+    std::printf("%12.6lf s: ", (record.timestamp_us - start_us) / 1e6);
+
+    if (record.type == lockin::record_frame && record.size >= sizeof(stream_frame_header_t)) {
+        stream_frame_header_t header;
+        std::memcpy(&header, record.data, sizeof(header));
+        std::printf("frame %u of type %u, %u channels of %u samples, %u dropped\n", header.sequence, header.type,
+            header.channel_count, header.channel_length, header.dropped_count);
+    } else if (record.type == lockin::record_result && record.size >= sizeof(double)) {
+        const double* values = reinterpret_cast<const double*>(record.data);
+        std::printf("result at %.6lf s:", values[0]);
+        for (size_t i = 1; i < record.size / sizeof(double); i++) std::printf(" %lg", values[i]);
+        std::printf("\n");
+    } else {
+        std::printf("record of type %u, %zu bytes\n", record.type, record.size);
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string path;
+    double seek_s = -1;
+    int count = 10;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--seek") == 0 && i + 1 < argc) seek_s = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--count") == 0 && i + 1 < argc) count = std::atoi(argv[++i]);
+        else if (argv[i][0] != '-' && path.empty()) path = argv[i];
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (path.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        lockin::recording_reader reader(path);
+        lockin::recording_info info = reader.info();
+        std::printf("Frequency %lf Hz, profile \"%s\", %zu calibration values, %zu chunks%s\n", info.frequency_hz,
+            info.profile.c_str(), info.calibration.size(), reader.chunk_count(),
+            reader.complete() ? "" : " (not closed, the index was rebuilt)");
+
+        lockin::record_view record;
+        lockin::recording_reader::cursor cursor = reader.begin();
+        if (!cursor.next(record)) {
+            std::printf("No records\n");
+            return 0;
+        }
+        int64_t start_us = record.timestamp_us;
+
+        if (seek_s >= 0) {
+            cursor = reader.seek(start_us + (int64_t) (seek_s * 1e6));
+            for (int i = 0; i < count && cursor.next(record); i++) print_record(record, start_us);
+
+            return 0;
+        }
+
+        uint64_t records = 1, frames = record.type == lockin::record_frame, bytes = record.size;
+        int64_t end_us = record.timestamp_us;
+        while (cursor.next(record)) {
+            records++;
+            frames += record.type == lockin::record_frame;
+            bytes += record.size;
+            end_us = record.timestamp_us;
+        }
+        std::printf("%" PRIu64 " records (%" PRIu64 " frames), %.1lf MB over %.3lf s\n", records, frames, bytes / 1e6,
+            (end_us - start_us) / 1e6);
+    } catch (const std::exception& exception) {
+        std::printf("ERROR: %s\n", exception.what());
+
+        return 1;
+    }
+
+    return 0;
+}
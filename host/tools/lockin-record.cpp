@@ -0,0 +1,153 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lockin/client.hpp"
+#include "lockin/firmware.h"
+#include "lockin/mock_device.hpp"
+#include "lockin/recording.hpp"
+
+// Records the capture stream (or the monitor results) of the device into a recording, reporting the throughput
+// every second. A profile given by name is selected on the device first
+
+void print_usage() {
+    std::printf("Usage: lockin-record [--mock] [--mock-rate BYTES_PER_S] [--serial SERIAL] [--results] [--seconds SECONDS]\n"
+        "                     [--profile NAME] [--calibration RE,IM;RE,IM;...] OUTPUT\n");
+}
+
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool parse_calibration(const char* text, std::vector<std::complex<double>>& calibration) {
+    while (*text != '\0') {
+        char* end;
+        double real = std::strtod(text, &end);
+        if (end == text || *end != ',') return false;
+        text = end + 1;
+
+        double imaginary = std::strtod(text, &end);
+        if (end == text || (*end != ';' && *end != '\0')) return false;
+        text = *end == ';' ? end + 1 : end;
+
+        calibration.emplace_back(real, imaginary);
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool mock = false, results = false;
+    std::string serial, output;
+    int seconds = 10;
+    lockin::recording_info info;
+    lockin::mock_settings settings;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--mock") == 0) mock = true;
+        else if (std::strcmp(argv[i], "--results") == 0) results = true;
+        else if (std::strcmp(argv[i], "--mock-rate") == 0 && i + 1 < argc) settings.link_bytes_per_s = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--serial") == 0 && i + 1 < argc) serial = argv[++i];
+        else if (std::strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) info.profile = argv[++i];
+        else if (std::strcmp(argv[i], "--calibration") == 0 && i + 1 < argc && parse_calibration(argv[i + 1], info.calibration)) i++;
+        else if (argv[i][0] != '-' && output.empty()) output = argv[i];
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (output.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    // The device lists its profiles in the same order as the firmware built for the host
+    int profile_index = -1;
+    for (uint32_t p = 0; p < firmware_get_profile_count(); p++) {
+        if (info.profile == firmware_get_profile_name(p)) profile_index = p;
+    }
+    if (!info.profile.empty() && profile_index < 0) {
+        std::printf("ERROR: The firmware has no %s profile\n", info.profile.c_str());
+        return 1;
+    }
+
+    try {
+        std::unique_ptr<lockin::transport> device;
+        if (mock) device = std::make_unique<lockin::mock_device>(settings);
+        else device = std::make_unique<lockin::usb_transport>(serial);
+
+        // Only the dispatch thread writes to the recording, so the readers never wait for the disk
+        lockin::recording_writer writer(output, info);
+        std::atomic<uint64_t> records{0};
+        bool have_frequency = false;
+
+        lockin::client client(std::move(device));
+        client.on_console_line([](const std::string& line) { std::printf("> %s\n", line.c_str()); });
+        if (results) {
+            client.on_result([&](const lockin::result& result) {
+                std::vector<double> values;
+                values.reserve(result.values.size() + 1);
+                values.push_back(result.time_s);
+                values.insert(values.end(), result.values.begin(), result.values.end());
+
+                writer.append(now_us(), lockin::record_result, values.data(), values.size() * sizeof(double));
+                records++;
+            });
+        } else {
+            client.on_frame([&](const lockin::capture_frame& frame) {
+                // Frames hold their own sampling plan, but the header is where readers look for the frequency
+                if (!have_frequency) {
+                    writer.set_frequency(frame.header.frequency_hz);
+                    have_frequency = true;
+                }
+
+                std::vector<uint8_t> record(sizeof(frame.header) + frame.payload.size());
+                std::memcpy(record.data(), &frame.header, sizeof(frame.header));
+                std::memcpy(record.data() + sizeof(frame.header), frame.payload.data(), frame.payload.size());
+
+                writer.append(now_us(), lockin::record_frame, record.data(), record.size());
+                records++;
+            });
+        }
+        client.start();
+        if (profile_index >= 0) client.send(std::string("P") + static_cast<char>('1' + profile_index));
+        client.send(results ? "M" : "S");
+
+        lockin::client_statistics last = client.statistics();
+        uint64_t last_records = 0;
+        for (int s = 0; s < seconds; s++) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            client.check();
+
+            lockin::client_statistics now = client.statistics();
+            uint64_t now_records = records;
+            std::printf("%8.1lf kB/s, %6llu records/s, dropped %llu by the device and %llu by the host\n",
+                (now.data_bytes - last.data_bytes) / 1000.0, (unsigned long long) (now_records - last_records),
+                (unsigned long long) now.device_dropped, (unsigned long long) now.host_dropped);
+            last = now;
+            last_records = now_records;
+        }
+
+        client.send("Q");
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        client.stop();
+        client.check();
+
+        writer.close();
+        std::printf("Recorded %llu records, %.1lf MB\n", (unsigned long long) records.load(), writer.bytes_written() / 1e6);
+    } catch (const std::exception& exception) {
+        std::printf("ERROR: %s\n", exception.what());
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lockin/replay.hpp"
+
+// Replays the captures of recordings through the processing of the firmware, printing every measurement as the time,
+// the temperature and either the component values (with a calibration in the recording) or the voltages
+
+void print_usage() {
+    std::printf("Usage: lockin-replay [--threads THREADS] [--iterations ITERATIONS] [--component R|C] [--flash IMAGE]\n"
+        "                     [--summary] RECORDING...\n");
+}
+
+int main(int argc, char** argv) {
+    lockin::replay_settings settings;
+    std::vector<std::string> paths;
+    std::string flash_image;
+    bool summary = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) settings.threads = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) settings.iterations = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--component") == 0 && i + 1 < argc) settings.component = argv[++i][0];
+        else if (std::strcmp(argv[i], "--flash") == 0 && i + 1 < argc) flash_image = argv[++i];
+        else if (std::strcmp(argv[i], "--summary") == 0) summary = true;
+        else if (argv[i][0] != '-') paths.push_back(argv[i]);
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (paths.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        if (!flash_image.empty()) lockin::load_flash_image(flash_image);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<lockin::replay_file> files = lockin::replay(paths, settings);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t captures = 0, capture_bytes = 0;
+        for (const lockin::replay_file& file : files) {
+            captures += file.captures;
+            capture_bytes += file.capture_bytes;
+
+            std::printf("%s: %zu measurements of %u captures with the %s profile\n", file.path.c_str(),
+                file.measurements.size(), file.iterations, file.profile.c_str());
+            if (summary) continue;
+
+            for (const lockin::replay_measurement& measurement : file.measurements) {
+                std::printf("%.6lf, %.2lf", measurement.time_s, measurement.temperature_c);
+                if (!measurement.values.empty()) {
+                    for (double value : measurement.values) std::printf(", %lf", value);
+                } else {
+                    for (const std::complex<double>& voltage : measurement.voltages) {
+                        std::printf(", %lf, %lf", voltage.real(), voltage.imag());
+                    }
+                }
+                std::printf("\n");
+            }
+        }
+
+        unsigned threads = settings.threads != 0 ? settings.threads : std::thread::hardware_concurrency();
+        std::printf("Replayed %llu captures (%.2lf GB) in %.2lf s on %u threads, %.0lf captures/s, %.1lf MB/s\n",
+            (unsigned long long) captures, capture_bytes / 1e9, seconds, threads, captures / seconds,
+            capture_bytes / 1e6 / seconds);
+    } catch (const std::exception& exception) {
+        std::printf("ERROR: %s\n", exception.what());
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "lockin/client.hpp"
+#include "lockin/mock_device.hpp"
+
+// Starts the capture stream (or the test stream) of the device, reports the throughput every second, and stops it
+
+void print_usage() {
+    std::printf("Usage: lockin-stream [--mock] [--serial SERIAL] [--test] [--seconds SECONDS]\n");
+}
+
+int main(int argc, char** argv) {
+    bool mock = false, test = false;
+    std::string serial;
+    int seconds = 10;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--mock") == 0) mock = true;
+        else if (std::strcmp(argv[i], "--test") == 0) test = true;
+        else if (std::strcmp(argv[i], "--serial") == 0 && i + 1 < argc) serial = argv[++i];
+        else if (std::strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = std::atoi(argv[++i]);
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    try {
+        std::unique_ptr<lockin::transport> device;
+        if (mock) device = std::make_unique<lockin::mock_device>();
+        else device = std::make_unique<lockin::usb_transport>(serial);
+
+        lockin::client client(std::move(device));
+        client.on_console_line([](const std::string& line) { std::printf("> %s\n", line.c_str()); });
+        client.start();
+        client.send(test ? "U" : "S");
+
+        lockin::client_statistics last = client.statistics();
+        for (int s = 0; s < seconds; s++) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            client.check();
+
+            lockin::client_statistics now = client.statistics();
+            std::printf("%8.1lf kB/s, %6llu frames/s, dropped %llu by the device and %llu by the host, %llu resyncs\n",
+                (now.data_bytes - last.data_bytes) / 1000.0, (unsigned long long) (now.frames - last.frames),
+                (unsigned long long) now.device_dropped, (unsigned long long) now.host_dropped,
+                (unsigned long long) now.resyncs);
+            last = now;
+        }
+
+        client.send("Q");
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        client.stop();
+        client.check();
+    } catch (const std::exception& exception) {
+        std::printf("ERROR: %s\n", exception.what());
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,13 +1,45 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-#include <tusb.h>
 #include <complex.h>
+
+// Set when the host replay tool builds this file, against its own emulation of the SDK (see host/src/firmware.c)
+#ifndef LOCKIN_REPLAY
+#define LOCKIN_REPLAY 0
+#endif
+
+#if !LOCKIN_REPLAY
+#include <tusb.h>
 #include "pico/stdlib.h"
+#include "pico/util/queue.h"
 #include "hardware/pwm.h"
 #include "hardware/clocks.h"
 #include "hardware/adc.h"
 #include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/interp.h"
+#include "hardware/structs/bus_ctrl.h"
+#include "hardware/structs/systick.h"
+#endif
+#include "lockin-stream.h"
+
+// The Cortex-M33 of the RP2350 has the DSP extension, so the demodulation uses its SIMD multiply-accumulate
+// instructions, while the Cortex-M0+ of the RP2040 uses the plain C kernels
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include <arm_acle.h>
+#define DSP_KERNELS 1
+#else
+#define DSP_KERNELS 0
+#endif
+
+// Marks the state of the capture processing. The replay tool runs the processing on several host threads at once,
+// so it makes this state thread local
+#ifndef PROCESSING_STATE
+#define PROCESSING_STATE
+#endif
 
 #define CLOCK_FREQ_HZ 270000000
 
@@ -15,84 +47,724 @@
 #define ADC_FREQ_DIVIDER 2
 #define ADC_FREQ_HZ (CLOCK_FREQ_HZ / ADC_FREQ_DIVIDER)
 
+// Every channel of the ADC round robin has its own DMA channel, starting at DMA_CHANNEL with the reference,
+// followed by the control channel which restarts the round robin and the done channel which ends the capture
 #define DMA_CHANNEL 0
+#define DMA_CONTROL_CHANNEL (DMA_CHANNEL + ADC_CHANNEL_COUNT)
+#define DMA_DONE_CHANNEL (DMA_CONTROL_CHANNEL + 1)
 
 #define PWM_PIN 0
+// The excitation can't go above MAX_EXCITATION_FREQ_HZ (about 11 kHz with one DUT and 5.5 kHz with three), where
+// every channel of the round robin gets just MIN_SAMPLES_PER_PERIOD decimated samples per period at the fastest
+// conversion rate. Close to that limit only some frequencies have a coherent plan
 #define PWM_FREQ 500
+
+// Also excite with a second tone from another PWM slice, summed with the first one by a resistor network, and
+// demodulate both from every capture. Its frequency is NUMERATOR / DENOMINATOR times PWM_FREQ, and a capture
+// holds DENOMINATOR periods of the first tone, so both tones have a whole number of periods in it. The ratio
+// has to keep the odd harmonics of both tones apart, which an odd NUMERATOR and even DENOMINATOR do
+#define DUAL_TONE 0
+#define SECOND_PWM_PIN 6
+#define SECOND_TONE_NUMERATOR 7
+#define SECOND_TONE_DENOMINATOR 2
+#define TONE_COUNT (DUAL_TONE ? 2 : 1)
+
+// Demodulate at the frequency of a signal from another instrument on the reference pin, instead of at PWM_FREQ
+#define EXTERNAL_REFERENCE 0
+// The reference frequency is measured by sampling the reference alone at this rate, first for RANGE_SAMPLES to
+// find its levels and then for WINDOW_SAMPLES to time its crossings, so the lowest frequency that can be measured
+// has to fit a whole period in the range samples
+#define EXTERNAL_REFERENCE_SAMPLE_RATE_HZ 200000
+#define EXTERNAL_REFERENCE_RANGE_SAMPLES 10000
+#define EXTERNAL_REFERENCE_WINDOW_SAMPLES 40000
+// Relative change of the reference frequency that makes the sampling be planned again
+#define EXTERNAL_REFERENCE_TOLERANCE 0.001
 #define DUTY_CYCLE_PERCENT 50
 
 #define REFERENCE_ADC_PIN 26
 #define INPUT_ADC_PIN (REFERENCE_ADC_PIN + 1)
 
+// Number of DUTs measured at the same time against the shared reference, each on its own ADC input
+// starting at INPUT_ADC_PIN (GPIO 27-29). Note that on the Pico boards GPIO 29 is wired to VSYS / 3,
+// so the third DUT input needs that divider removed
+#define DUT_COUNT 1
+
+// When enabled, the on-die temperature sensor (ADC input 4 on the RP2040 and RP2350A) is read with a single
+// conversion after every capture. It stays out of the round robin, which keeps the whole ADC rate for the inputs
+#define TEMPERATURE_SENSING 1
+#define TEMPERATURE_ADC_INPUT ADC_TEMPERATURE_CHANNEL_NUM
+
+#define ADC_CHANNEL_COUNT (1 + DUT_COUNT)
+
+#if DUT_COUNT < 1 || DUT_COUNT > 3
+#error "DUT_COUNT must be between 1 and 3"
+#endif
+
+// Optional external analog multiplexer in front of every DUT input, selected by MUX_SELECT_PIN_COUNT
+// consecutive GPIOs starting at MUX_SELECT_BASE_PIN (0 disables the multiplexer)
+#define MUX_SELECT_PIN_COUNT 0
+#define MUX_SELECT_BASE_PIN 2
+#define MUX_CHANNEL_COUNT (1 << MUX_SELECT_PIN_COUNT)
+#define MUX_SETTLING_US 2000
+
+// Every DUT position that can be measured, through all the ADC inputs and multiplexer channels
+#define DUT_POSITION_COUNT (DUT_COUNT * MUX_CHANNEL_COUNT)
+
 #define INPUT_SAMPLE_ITERATIONS 1024
 #define INPUT_SAMPLE_SIZE 4
 
+// A conversion takes 96 ADC clock cycles, so the sample period can't be any shorter than that
+#define ADC_MIN_CYCLES_PER_SAMPLE 96
+
+// Number of whole excitation periods (of the first tone) held by each capture
+#define CAPTURE_PERIODS (DUAL_TONE ? SECOND_TONE_DENOMINATOR : 1)
+
+// The reference has to go this far under its average (in ADC units) before a rising crossing is accepted,
+// so that noise around the average can't trigger it
+#define ZERO_CROSSING_HYSTERESIS 16
+// Fraction bits of the interpolated zero crossing position
+#define CROSSING_FRACTION_BITS 8
+
+// How the per-capture estimates (complex, so the real and imaginary parts are kept or left out together) are
+// combined into the result
+typedef enum {
+    // Plain mean of every capture
+    AVERAGE_MEAN,
+    // Mean of the block of captures closest to the median of all the blocks
+    AVERAGE_MEDIAN_OF_MEANS,
+    // Mean of the captures, leaving out the blocks far from the median
+    AVERAGE_TRIMMED_MEAN
+} average_t;
+
+// The captures of a measurement are split into this many blocks, so the memory doesn't grow with the iterations
+#define AVERAGE_BLOCK_COUNT 32
+// Blocks further from the median (of the real and imaginary parts) than this many times the median distance are
+// outliers. A Gaussian block is that far from the center only 0.2% of the time
+#define AVERAGE_OUTLIER_THRESHOLD 3.0
+
+// Track the reference phase across captures instead of searching for the zero crossing in each one
+#define PHASE_TRACKING 1
+// Loop gains applied to the phase error (in periods), while acquiring and once locked, and to the frequency. The
+// frequency only moves with an external reference, as the PWM is the reference otherwise
+#define PHASE_TRACKER_ACQUISITION_GAIN 0.5f
+#define PHASE_TRACKER_PHASE_GAIN 0.1f
+#define PHASE_TRACKER_FREQUENCY_GAIN 0.01f
+// The tracker locks after LOCK_CAPTURES consecutive errors under LOCK_THRESHOLD, and unlocks after
+// UNLOCK_CAPTURES consecutive errors over UNLOCK_THRESHOLD or captures without a usable reference (in periods)
+#define PHASE_TRACKER_LOCK_THRESHOLD 0.005f
+#define PHASE_TRACKER_LOCK_CAPTURES 16
+#define PHASE_TRACKER_UNLOCK_THRESHOLD 0.05f
+#define PHASE_TRACKER_UNLOCK_CAPTURES 4
+// Minimum amplitude of the reference fundamental (in ADC units) for a capture to update the tracker
+#define PHASE_TRACKER_MIN_AMPLITUDE 16.0f
+// Captures further apart than this aren't consecutive captures of a measurement (the console, the trigger or the
+// monitor schedule came in between), so an external reference is acquired again instead of extrapolated
+#define PHASE_TRACKER_MAX_GAP_US 100000
+
+// CIC decimation of every channel before the demodulation, trading the excess ADC sample rate for
+// resolution. The decimation ratio is 2^CIC_DECIMATION_BITS (0 disables the filter) and CIC_ORDER is the
+// number of integrator and comb stages. CIC_FRACTION_BITS of the extra resolution are kept in the samples,
+// at most 3 so that the samples minus their average still fit the signed 16-bit demodulation kernels
+#define CIC_DECIMATION_BITS 2
+#define CIC_DECIMATION (1 << CIC_DECIMATION_BITS)
+#define CIC_ORDER 3
+#define CIC_FRACTION_BITS 3
+
+// Fraction bits of the processed samples, on top of the 12 bits of the ADC
+#define SAMPLE_FRACTION_BITS (CIC_DECIMATION > 1 ? CIC_FRACTION_BITS : 0)
+#define SAMPLE_MIDSCALE (1 << (11 + SAMPLE_FRACTION_BITS))
+
+#if CIC_FRACTION_BITS > 3
+#error "CIC_FRACTION_BITS must be at most 3"
+#endif
+
+// The ADC codes are corrected for the converter nonlinearity with a lookup table, giving values with
+// ADC_CORRECTION_FRACTION_BITS of fraction. The table is measured with a histogram test of ADC_CALIBRATION_SAMPLES
+// samples of a slow ramp covering the whole range (at least ADC_CALIBRATION_MIN_CODES codes) and kept in the last
+// sectors of the flash
+#define ADC_CORRECTION_FRACTION_BITS 2
+#define ADC_CALIBRATION_SAMPLE_RATE_HZ 500000
+#define ADC_CALIBRATION_SAMPLES (1 << 22)
+// Blocks the samples are taken in, printing the progress after each
+#define ADC_CALIBRATION_BLOCKS 64
+#define ADC_CALIBRATION_MIN_CODES 3072
+#define ADC_CORRECTION_MAGIC 0x4C4E4941
+#define ADC_CORRECTION_FLASH_SIZE ((sizeof(adc_correction_t) + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE)
+#define ADC_CORRECTION_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - ADC_CORRECTION_FLASH_SIZE)
+
+// The name of the selected measurement profile is kept in the flash sector right before the ADC correction, along
+// with the bin limits under their own magic, so that either can be missing
+#define PROFILE_MAGIC 0x464F5250
+#define BIN_LIMITS_MAGIC 0x534D4C42
+#define PROFILE_FLASH_OFFSET (ADC_CORRECTION_FLASH_OFFSET - FLASH_SECTOR_SIZE)
+#define DEFAULT_PROFILE 1
+// Single capture measurements, with every DUT open circuit, used to estimate the time and noise floor of each profile
+#define PROFILE_CHARACTERIZATION_RUNS 32
+
+// When no host connects within HEADLESS_DELAY_US of booting, measurements are logged to a ring of LOG_RAM_RECORDS
+// records, which is spilled a flash page at a time to a circular log of LOG_FLASH_SECTORS sectors right before
+// the profile sector. Every sector starts with a header page, and is only erased when the log wraps around to it
+#define HEADLESS_DELAY_US 5000000
+#define LOG_RAM_RECORDS 64
+#define LOG_FLASH_SECTORS 64
+#define LOG_MAGIC 0x474F4C52
+#define LOG_FLASH_OFFSET (PROFILE_FLASH_OFFSET - LOG_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+
+#if CIC_DECIMATION > 1 && (12 + ADC_CORRECTION_FRACTION_BITS + CIC_ORDER * CIC_DECIMATION_BITS > 32 \
+    || CIC_ORDER * CIC_DECIMATION_BITS + ADC_CORRECTION_FRACTION_BITS < CIC_FRACTION_BITS)
+#error "CIC filter output doesn't fit in 32 bits or has less than CIC_FRACTION_BITS of extra resolution"
+#endif
+
+// Limits for the number of samples of each channel in one excitation period
+#define MIN_SAMPLES_PER_PERIOD 16
+#define MAX_SAMPLES_PER_PERIOD 2048
+
+#define MAX_EXCITATION_FREQ_HZ \
+    ((double) ADC_FREQ_HZ / (ADC_CHANNEL_COUNT * ADC_MIN_CYCLES_PER_SAMPLE * MIN_SAMPLES_PER_PERIOD * CIC_DECIMATION))
+
+#if PWM_FREQ * ADC_CHANNEL_COUNT * ADC_MIN_CYCLES_PER_SAMPLE * MIN_SAMPLES_PER_PERIOD * CIC_DECIMATION > ADC_FREQ_HZ
+#error "PWM_FREQ is above the highest frequency the ADC can sample every channel at (MAX_EXCITATION_FREQ_HZ)"
+#endif
+
+// How many system clock cycles the excitation period may be moved away from PWM_FREQ
+// when no coherent sampling setup exists for the exact frequency
+#define MAX_PERIOD_ADJUSTMENT_CYCLES 64
+
+// Demodulators available for extracting the input voltage from the captures
+typedef enum {
+    // Picks 4 input samples a quarter period apart, only measures the fundamental
+    DEMODULATOR_FOUR_POINT,
+    // Correlates every input sample with the fundamental and odd harmonics of the excitation
+    DEMODULATOR_HARMONIC
+} demodulator_t;
+
+// Only the phase tracker follows the first tone when the reference is the sum of both. The demodulator comes from
+// the measurement profile, except that two tones always use the harmonic one (see get_demodulator)
+_Static_assert(!DUAL_TONE || (PHASE_TRACKING && !EXTERNAL_REFERENCE),
+    "DUAL_TONE needs phase tracking, without an external reference");
+
+// Number of odd harmonics (including the fundamental) measured by the harmonic demodulator, so 4 means
+// the 1st, 3rd, 5th and 7th, as the square wave excitation has no even harmonics
+#define HARMONIC_COUNT 4
+// Every tone is demodulated at each of its harmonics
+#define DEMODULATED_COUNT (HARMONIC_COUNT * TONE_COUNT)
+#define SINE_TABLE_FRACTION_BITS 14
+
+// Correlation kernels of the harmonic demodulator
+typedef enum {
+    // Dot product with the precomputed sine and cosine tables of each harmonic (SMLALD on the RP2350)
+    KERNEL_TABLE,
+    // Phase accumulator and sine table addressing done by the SIO interpolators, one table for every harmonic
+    KERNEL_INTERPOLATOR
+} harmonic_kernel_t;
+
+// The RP2350 correlates the tables with SMLALD, which beats the interpolators. The replay tool on the host runs
+// the interpolator kernel on a software model of them, which the replay test checks against the tables
+#define HARMONIC_KERNEL (DSP_KERNELS ? KERNEL_TABLE : KERNEL_INTERPOLATOR)
+
+// The interpolator sine table has 2^INTERPOLATOR_TABLE_BITS entries, so the phase wraps by masking
+#define INTERPOLATOR_TABLE_BITS 12
+
+// Demodulation scratch buffers up to this many samples live in SCRATCH_X, a separate 4 KB SRAM bank that isn't
+// striped with main SRAM. Core 1 doesn't run, so only the top half of the bank is kept for its stack
+#define SCRATCH_DEMODULATION_SAMPLES 768
+
+// Number of times each step of the processing runs when benchmarking
+#define BENCHMARK_RUNS 256
+
+// Set by the SDK for copy_to_ram builds, where the whole program runs from SRAM
+#ifndef PICO_COPY_TO_RAM
+#define PICO_COPY_TO_RAM 0
+#endif
+
+#if PICO_RP2350
+#define PLATFORM_NAME "RP2350"
+#else
+#define PLATFORM_NAME "RP2040"
+#endif
+
 #define RI 9500
 #define RS 100000
 
-// ADC capture buffer should fit two periods: one from the reference and another from input
-uint adc_capture_buffer_size = ((1000000 / PWM_FREQ) / (96.0 * 1000000 / ADC_FREQ_HZ)) + 1;
-uint16_t* adc_capture_buffer;
+// Per-unit temperature coefficients, found by calibrating the same unit at two temperatures. RI drifts with
+// its own coefficient, while the ADC reference and the excitation amplitude scale the open circuit voltage
+#define RI_TEMPCO_PPM_PER_C 0.0
+#define OPEN_VOLTAGE_TEMPCO_PPM_PER_C 0.0
+
+// Triggered single shot measurements. The first capture starts from the interrupt of the TRIGGER_EDGE on
+// TRIGGER_PIN, and the measurement takes TRIGGER_ITERATIONS captures
+#define TRIGGER_PIN 15
+#define TRIGGER_EDGE GPIO_IRQ_EDGE_RISE
+#define TRIGGER_ITERATIONS 32
+
+// Time series monitoring. A measurement with the current profile starts every MONITOR_PERIOD_US, and the
+// schedule jitter is reported every MONITOR_REPORT_MEASUREMENTS measurements. The period is stretched when a
+// measurement timed at the start, with MONITOR_TIMING_MARGIN for the variation between them, takes longer
+#define MONITOR_PERIOD_US 5000000
+#define MONITOR_TIMING_MARGIN 1.2
+#define MONITOR_REPORT_MEASUREMENTS 60
+
+// Binary streaming on the vendor USB interface, reporting the throughput every STREAM_REPORT_US. Full speed bulk
+// transfers carry at most 19 packets of 64 bytes per 1 ms frame. When stopped, the frame going out gets up to
+// STREAM_FINISH_TIMEOUT_US to finish, so the host never takes the start of the next stream as the rest of it
+#define STREAM_REPORT_US 1000000
+#define STREAM_FINISH_TIMEOUT_US 100000
+#define USB_FULL_SPEED_BULK_BYTES_PER_S (19 * 64 * 1000)
+
+// Part handler binning. A measurement starts when BIN_START_PIN goes low, then the bin number is put on the
+// BIN_OUTPUT_PIN_COUNT pins from BIN_OUTPUT_BASE_PIN and BIN_END_OF_TEST_PIN pulses high for BIN_STROBE_US
+#define BIN_START_PIN 10
+#define BIN_OUTPUT_BASE_PIN 11
+#define BIN_OUTPUT_PIN_COUNT 3
+#define BIN_END_OF_TEST_PIN 14
+#define BIN_STROBE_US 10
+// Bin 0 is for the parts that fit in no bin, so the outputs number this many bins with limits
+#define BIN_MAX_COUNT ((1 << BIN_OUTPUT_PIN_COUNT) - 1)
+// The spread of repeated measurements must be under this fraction of the tightest bin tolerance. It's measured
+// over BIN_PROFILE_RUNS measurements of the first part with the fastest profile, and scaled to the others
+#define BIN_RESOLUTION_FRACTION 0.1
+#define BIN_PROFILE_RUNS 8
+// Longest number typed at the console, such as a bin limit
+#define CONSOLE_NUMBER_LENGTH 32
+// Throughput is reported every this many parts
+#define BIN_REPORT_PARTS 100
+
+// Clock setup that makes every capture hold an exact integer number of excitation periods,
+// so the sample positions relative to the reference never drift and the demodulation is exact
+typedef struct {
+    // Excitation period in system clock cycles
+    uint period_cycles;
+    // PWM clock divider in 1/16 steps (the 8.4 fixed point format of the PWM divider)
+    uint pwm_divider_16ths;
+    uint16_t pwm_wrap;
+    // ADC sample period (1 + INT + FRAC / 256) in ADC clock cycles, in 1/256 steps
+    uint adc_period_256ths;
+    // Samples of each channel (reference or DUT input) in one excitation period
+    uint samples_per_period;
+    // Samples of each channel in one excitation period after the CIC decimation
+    uint decimated_samples_per_period;
+    // Actual excitation frequency, which may differ slightly from PWM_FREQ
+    double frequency_hz;
+    // PWM setup of the second tone, when DUAL_TONE is enabled
+    uint second_pwm_divider_16ths;
+    uint16_t second_pwm_wrap;
+} sampling_plan_t;
+
+PROCESSING_STATE sampling_plan_t sampling_plan;
+
+// ADC capture buffer holds CAPTURE_PERIODS periods of every channel of the round robin, one channel after
+// the other: first the reference, then every DUT input
+PROCESSING_STATE uint adc_capture_buffer_size;
+PROCESSING_STATE uint adc_channel_length;
+PROCESSING_STATE uint16_t* adc_capture_buffer;
+
+// Samples used by the demodulators, in the same layout as the capture buffer but after the CIC decimation
+// and with SAMPLE_FRACTION_BITS of fraction (the capture buffer itself when the filter is disabled)
+PROCESSING_STATE uint sample_buffer_size;
+PROCESSING_STATE uint sample_channel_length;
+PROCESSING_STATE uint16_t* sample_buffer;
+
+// Corrected value of every ADC code, with ADC_CORRECTION_FRACTION_BITS of fraction, copied from the flash
+// so the lookups don't go through the XIP cache
+PROCESSING_STATE uint16_t adc_correction_table[1 << 12];
+
+typedef struct {
+    uint32_t magic;
+    uint32_t fraction_bits;
+    uint16_t table[1 << 12];
+} adc_correction_t;
+
+// Measurement settings that trade speed for accuracy, selected at runtime
+typedef struct {
+    const char* name;
+    // Captures averaged by every measurement
+    uint iterations;
+    // Excitation frequency, unless following an external reference
+    double frequency_hz;
+    average_t average;
+    demodulator_t demodulator;
+} measurement_profile_t;
+
+// From the fastest to the most precise, which is also the order the binning tries them in
+const measurement_profile_t measurement_profiles[] = {
+    { "fast", 128, PWM_FREQ, AVERAGE_MEDIAN_OF_MEANS, DEMODULATOR_HARMONIC },
+    { "normal", 8192, PWM_FREQ, AVERAGE_TRIMMED_MEAN, DEMODULATOR_HARMONIC },
+    { "precise", 65536, PWM_FREQ, AVERAGE_TRIMMED_MEAN, DEMODULATOR_HARMONIC }
+};
+#define PROFILE_COUNT (sizeof(measurement_profiles) / sizeof(measurement_profiles[0]))
+
+PROCESSING_STATE uint measurement_profile_index = DEFAULT_PROFILE;
+
+typedef struct {
+    // Nominal value, in ohms or nF like the results, and tolerance around it
+    double nominal;
+    double tolerance_percent;
+} bin_limit_t;
+
+// Parts go to the first bin they fit in, numbered from 1, and to bin 0 if they fit in none
+bin_limit_t bin_limits[BIN_MAX_COUNT] = {
+    { 10000, 1 },
+    { 10000, 5 },
+    { 10000, 10 }
+};
+uint bin_count = 3;
+
+typedef struct {
+    uint32_t magic;
+    // Kept by name, so that the profile table can change between firmware versions
+    char name[16];
+    uint32_t bin_limits_magic;
+    uint32_t bin_count;
+    bin_limit_t bin_limits[BIN_MAX_COUNT];
+} stored_profile_t;
+
+_Static_assert(sizeof(stored_profile_t) <= FLASH_PAGE_SIZE, "The stored profile doesn't fit in a flash page");
+
+// Uncalibrated result of a headless measurement, as there's no open circuit measurement without an operator
+typedef struct {
+    uint32_t sequence;
+    uint32_t time_ms;
+    float frequency_hz;
+    float temperature_c;
+    // Real and imaginary part of the fundamental voltage of every DUT position
+    float voltages[2 * DUT_POSITION_COUNT];
+} log_record_t;
+
+typedef struct {
+    uint32_t magic;
+    // Increases with every sector started, and gives the sequence of the first record in the sector
+    uint32_t sector_sequence;
+    uint32_t first_record_sequence;
+    // Sectors written by a firmware with other records (another DUT count) are left out
+    uint32_t record_size;
+} log_sector_header_t;
+
+#define LOG_RECORDS_PER_PAGE (FLASH_PAGE_SIZE / sizeof(log_record_t))
+#define LOG_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+_Static_assert(LOG_RAM_RECORDS >= LOG_RECORDS_PER_PAGE, "LOG_RAM_RECORDS must hold at least a flash page of records");
+
+// Records not yet spilled to the flash, the oldest LOG_RECORDS_PER_PAGE of them are written out together
+log_record_t log_ring[LOG_RAM_RECORDS];
+uint log_ring_head;
+uint log_ring_count;
+uint32_t log_record_sequence;
+
+// Sector of the flash log being filled, and its next free page
+uint log_sector;
+uint log_page;
+uint32_t log_sector_sequence;
+
+// Entries written by the control DMA channel to the multi channel trigger register after every round robin
+PROCESSING_STATE uint32_t* dma_trigger_table;
+
+// Published by the DMA interrupt when a capture is complete
+typedef struct {
+    uint16_t* buffer;
+    // Sum of the raw reference samples, added up by the DMA sniffer
+    uint32_t reference_sum;
+    // Cycle counter value when the capture completed
+    uint32_t done_count;
+} capture_event_t;
+
+PROCESSING_STATE queue_t capture_queue;
+
+// Copied from the DMA sniffer by the done DMA channel at the end of the capture
+PROCESSING_STATE volatile uint32_t dma_sniffed_sum;
+
+// Sum of the raw reference samples of the last capture
+PROCESSING_STATE uint32_t capture_reference_sum;
+
+// Cycles between the end of the last capture and the start of its processing
+PROCESSING_STATE uint32_t capture_latency_cycles;
+
+// Excitation PWM counters and time when the last capture started
+PROCESSING_STATE uint16_t capture_start_pwm_count;
+PROCESSING_STATE uint16_t capture_start_second_pwm_count;
+PROCESSING_STATE uint64_t capture_start_us;
+
+uint16_t* get_capture_channel(uint channel) {
+    return adc_capture_buffer + channel * adc_channel_length;
+}
+
+uint16_t* get_sample_channel(uint channel) {
+    return sample_buffer + channel * sample_channel_length;
+}
+
+// Temperature sensor code read after the last capture, and the sum of them since the last reset
+PROCESSING_STATE uint16_t capture_temperature_code;
+PROCESSING_STATE uint64_t temperature_accumulator;
+PROCESSING_STATE uint temperature_sample_count;
+
+// One period of the sine and cosine of every harmonic in fixed point, used by the harmonic demodulator
+PROCESSING_STATE int16_t* harmonic_tables;
+
+// Input samples of one DUT lined up after the zero crossing, as signed 16-bit values for the correlation
+PROCESSING_STATE int16_t* demodulation_scratch;
+PROCESSING_STATE int16_t __scratch_x("demodulation") scratch_demodulation_buffer[SCRATCH_DEMODULATION_SAMPLES];
+
+// One period of a sine wave with a power of two size, addressed by the interpolators
+PROCESSING_STATE int16_t* interpolator_sine_table;
+
+// Cosine and sine of the rotation from the sample before the zero crossing to the crossing itself, for every
+// demodulated frequency and every fraction of a sample the crossing can fall at, in fixed point
+PROCESSING_STATE int16_t* crossing_rotation_table;
+
+int16_t* get_harmonic_table(uint index, bool cosine) {
+    return harmonic_tables + (2 * index + cosine) * sampling_plan.decimated_samples_per_period * CAPTURE_PERIODS;
+}
+
+const int16_t* get_crossing_rotation(uint index, uint fraction) {
+    return crossing_rotation_table + 2 * ((index << CROSSING_FRACTION_BITS) + fraction);
+}
+
+uint find_pwm_divider(uint period_cycles) {
+    // The PWM period is (wrap + 1) * divider, so look for the smallest divider that splits
+    // the period exactly while keeping the wrap value within 16 bits
+    uint64_t period_16ths = (uint64_t) period_cycles * 16;
+    uint min_divider_16ths = (period_16ths + 65535) / 65536;
+    if (min_divider_16ths < 16) min_divider_16ths = 16;
+
+    for (uint divider = min_divider_16ths; divider < 256 * 16; divider++) {
+        if (period_16ths % divider == 0) return divider;
+    }
+
+    return 0;
+}
+
+bool plan_period_sampling(uint period_cycles, sampling_plan_t* plan) {
+    uint64_t period_16ths = (uint64_t) period_cycles * 16;
+    uint pwm_divider_16ths = find_pwm_divider(period_cycles);
+    if (pwm_divider_16ths == 0) return false;
+
+    // The second tone fits NUMERATOR periods in DENOMINATOR of the first one, also a whole number of cycles
+    uint second_period_cycles = 0, second_pwm_divider_16ths = 0;
+    if (DUAL_TONE) {
+        if ((uint64_t) period_cycles * SECOND_TONE_DENOMINATOR % SECOND_TONE_NUMERATOR != 0) return false;
+
+        second_period_cycles = (uint64_t) period_cycles * SECOND_TONE_DENOMINATOR / SECOND_TONE_NUMERATOR;
+        second_pwm_divider_16ths = find_pwm_divider(second_period_cycles);
+        if (second_pwm_divider_16ths == 0) return false;
+    }
+
+    // The ADC samples every channel in turn, so one period must split into ADC_CHANNEL_COUNT * samples_per_period
+    // ADC sample periods, each a multiple of 1/256 of an ADC clock cycle
+    uint64_t period_adc_256ths = (uint64_t) period_cycles * 256 / ADC_FREQ_DIVIDER;
+    if ((uint64_t) period_cycles * 256 % ADC_FREQ_DIVIDER != 0) return false;
+
+    uint max_samples = period_adc_256ths / (ADC_CHANNEL_COUNT * ADC_MIN_CYCLES_PER_SAMPLE * 256);
+    if (max_samples > MAX_SAMPLES_PER_PERIOD) max_samples = MAX_SAMPLES_PER_PERIOD;
+
+    // The samples taken by the demodulator must fall exactly on a multiple of the sample spacing, even after decimation
+    uint samples_step = INPUT_SAMPLE_SIZE * CIC_DECIMATION;
+    max_samples -= max_samples % samples_step;
+
+    for (uint samples = max_samples; samples >= MIN_SAMPLES_PER_PERIOD * CIC_DECIMATION; samples -= samples_step) {
+        if (period_adc_256ths % (ADC_CHANNEL_COUNT * samples) != 0) continue;
+
+        plan->period_cycles = period_cycles;
+        plan->pwm_divider_16ths = pwm_divider_16ths;
+        plan->pwm_wrap = period_16ths / pwm_divider_16ths - 1;
+        plan->adc_period_256ths = period_adc_256ths / (ADC_CHANNEL_COUNT * samples);
+        plan->samples_per_period = samples;
+        plan->decimated_samples_per_period = samples / CIC_DECIMATION;
+        plan->frequency_hz = (double) CLOCK_FREQ_HZ / period_cycles;
+        plan->second_pwm_divider_16ths = second_pwm_divider_16ths;
+        plan->second_pwm_wrap = DUAL_TONE ? (uint64_t) second_period_cycles * 16 / second_pwm_divider_16ths - 1 : 0;
+
+        return true;
+    }
+
+    return false;
+}
+
+bool plan_coherent_sampling(double frequency_hz, sampling_plan_t* plan) {
+    uint nominal_period_cycles = round((double) CLOCK_FREQ_HZ / frequency_hz);
+
+    // Try the exact period first, then move it one cycle at a time to each side
+    for (int offset = 0; offset <= MAX_PERIOD_ADJUSTMENT_CYCLES; offset++) {
+        if (plan_period_sampling(nominal_period_cycles + offset, plan)) return true;
+        if (offset != 0 && plan_period_sampling(nominal_period_cycles - offset, plan)) return true;
+    }
+
+    printf("ERROR WHILE PLANNING COHERENT SAMPLING FOR %.4lf Hz!\n", frequency_hz);
+    if (frequency_hz > MAX_EXCITATION_FREQ_HZ) {
+        printf("The highest frequency with %d ADC channels is %.1lf Hz\n", ADC_CHANNEL_COUNT, MAX_EXCITATION_FREQ_HZ);
+    }
+
+    return false;
+}
+
+void print_sampling_plan() {
+    printf("Excitation: %.4lf Hz, %u samples per period on each channel, ADC sample every %.3f cycles\n",
+        sampling_plan.frequency_hz, sampling_plan.samples_per_period, sampling_plan.adc_period_256ths / 256.0f);
+    if (CIC_DECIMATION > 1) {
+        printf("CIC decimation: order %d, ratio %d, %u samples per period\n",
+            CIC_ORDER, CIC_DECIMATION, sampling_plan.decimated_samples_per_period);
+    }
+    if (DUAL_TONE) {
+        printf("Second tone: %.4lf Hz, %d periods of it and %d of the first tone in each capture\n",
+            sampling_plan.frequency_hz * SECOND_TONE_NUMERATOR / SECOND_TONE_DENOMINATOR,
+            SECOND_TONE_NUMERATOR, SECOND_TONE_DENOMINATOR);
+    }
+}
 
 // For an explanation in how the PWM works, visit the URL below
 // https://www.i-programmer.info/programming/hardware/14849-the-pico-in-c-basic-pwm.html?start=1
 void init_pwm() {
-    // Allocate gpio 1 to PWM
-    gpio_set_function(PWM_PIN, GPIO_FUNC_PWM);
+    // Allocate gpio 1 to PWM. With an external reference the slice still runs as the time base of the phase
+    // tracker, but doesn't drive the pin
+    if (!EXTERNAL_REFERENCE) gpio_set_function(PWM_PIN, GPIO_FUNC_PWM);
 
     // Find out which PWM slice and channel is connected to GPIO 1
     uint slice_num = pwm_gpio_to_slice_num(PWM_PIN);
     uint channel = pwm_gpio_to_channel(PWM_PIN);
 
-    // Calculate how much we need to divide the clock frequency
-    // Using 2048 instead of 4096 as in the website because of the overclock
-    float clock_divider = ceil(CLOCK_FREQ_HZ / (2048 * PWM_FREQ)) / 16;
-    pwm_set_clkdiv(slice_num, clock_divider);
-
-    // Calculate the wrap value of the PWM counter (how much it counts before resetting)
-    float divided_clock_freq = CLOCK_FREQ_HZ / clock_divider;
-    uint16_t counter_wrap = (divided_clock_freq / PWM_FREQ) - 1;
-    pwm_set_wrap(slice_num, counter_wrap);
+    // Use the divider and wrap value from the sampling plan, so that the period is an exact number of
+    // system clock cycles and matches the ADC sample period
+    pwm_set_clkdiv_int_frac(slice_num, sampling_plan.pwm_divider_16ths / 16, sampling_plan.pwm_divider_16ths % 16);
+    pwm_set_wrap(slice_num, sampling_plan.pwm_wrap);
 
     // Calculate the level (count value) at which the PWM should switch between 1 and 0
-    uint16_t level = counter_wrap / (100 / DUTY_CYCLE_PERCENT);
+    uint16_t level = (sampling_plan.pwm_wrap + 1) * DUTY_CYCLE_PERCENT / 100;
     pwm_set_chan_level(slice_num, channel, level);
 
-    // Enable PWM
-    pwm_set_enabled(slice_num, true);
+    if (!DUAL_TONE) {
+        // Enable PWM
+        pwm_set_enabled(slice_num, true);
+        return;
+    }
+
+    uint second_slice_num = pwm_gpio_to_slice_num(SECOND_PWM_PIN);
+    gpio_set_function(SECOND_PWM_PIN, GPIO_FUNC_PWM);
+    pwm_set_clkdiv_int_frac(second_slice_num, sampling_plan.second_pwm_divider_16ths / 16, sampling_plan.second_pwm_divider_16ths % 16);
+    pwm_set_wrap(second_slice_num, sampling_plan.second_pwm_wrap);
+    pwm_set_chan_level(second_slice_num, pwm_gpio_to_channel(SECOND_PWM_PIN), (sampling_plan.second_pwm_wrap + 1) * DUTY_CYCLE_PERCENT / 100);
+
+    // Start both slices from zero at the same time, so that they wrap together at the start of every capture
+    // window and the phase between the tones is always the same
+    pwm_set_enabled(slice_num, false);
+    pwm_set_enabled(second_slice_num, false);
+    pwm_set_counter(slice_num, 0);
+    pwm_set_counter(second_slice_num, 0);
+    pwm_set_mask_enabled((1u << slice_num) | (1u << second_slice_num));
+}
+
+void start_cycle_counter() {
+    // SysTick counts down from 2^24 - 1 at the system clock, enough for any step that takes less than 62 ms
+    systick_hw->rvr = 0x00FFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;
+}
+
+static inline uint32_t read_cycle_counter() {
+    return systick_hw->cvr;
+}
+
+void __not_in_flash_func(capture_done_handler)() {
+    dma_hw->ints0 = 1u << DMA_DONE_CHANNEL;
+
+    // Stop any new conversions from starting
+    adc_run(false);
+
+    capture_event_t event = { adc_capture_buffer, dma_sniffed_sum, read_cycle_counter() };
+    queue_try_add(&capture_queue, &event);
+}
+
+uint get_round_robin_mask() {
+    // Sets the ADC to switch between reading reference and every DUT input using a mask
+    uint input_mask = 1 << (REFERENCE_ADC_PIN - ADC_BASE_PIN);
+    for (int i = 0; i < DUT_COUNT; i++) {
+        input_mask |= 1 << (INPUT_ADC_PIN + i - ADC_BASE_PIN);
+    }
+
+    return input_mask;
 }
 
 bool init_adc() {
     adc_init();
     
     adc_gpio_init(REFERENCE_ADC_PIN);
-    adc_gpio_init(INPUT_ADC_PIN);
+    for (int i = 0; i < DUT_COUNT; i++) {
+        adc_gpio_init(INPUT_ADC_PIN + i);
+    }
 
     // Set the ADC clock source register to use the system clock
     clock_configure(clk_adc, 0, CLOCKS_CLK_ADC_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS, CLOCK_FREQ_HZ, ADC_FREQ_HZ);
 
-    // Sets the ADC to switch between reading reference and input using a mask
-    uint input_mask = 1 << (REFERENCE_ADC_PIN - ADC_BASE_PIN) | 1 << (INPUT_ADC_PIN - ADC_BASE_PIN);
-    adc_set_round_robin(input_mask);
+    if (TEMPERATURE_SENSING) adc_set_temp_sensor_enabled(true);
+    adc_set_round_robin(get_round_robin_mask());
 
     // Set up the ADC FIFO to write every sample to the FIFO, call the DMA interrupt every sample,
     // disable the error bit and maintain 12-bit samples
     adc_fifo_setup(true, true, 1, false, false);
 
-    // Get DMA channel and default config
-    dma_channel_claim(DMA_CHANNEL);
-    dma_channel_start(DMA_CHANNEL);
-    dma_channel_config cfg = dma_channel_get_default_config(DMA_CHANNEL);
+    // Give the DMA priority over the processor on the bus, so that processing never delays a transfer
+    // and the ADC FIFO can't overflow
+    bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_W_BITS | BUSCTRL_BUS_PRIORITY_DMA_R_BITS;
 
-    // Reading from constant address, writing to incrementing byte addresses, transferring 16 bits
-    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
-    channel_config_set_read_increment(&cfg, false);
-    channel_config_set_write_increment(&cfg, true);
+    // One DMA channel per ADC channel, each moving a single sample from the ADC FIFO into its own part of
+    // the capture buffer and then triggering the next one, the last one triggering the control channel.
+    // The buffer addresses are set at the start of every capture, as the buffers change with the sampling plan
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+        dma_channel_claim(DMA_CHANNEL + c);
+        dma_channel_config cfg = dma_channel_get_default_config(DMA_CHANNEL + c);
 
-    // Pace transfers based on availability of ADC samples
-    channel_config_set_dreq(&cfg, DREQ_ADC);
-    
-    // Allocate the buffer on memory
+        // Reading from constant address, writing to incrementing byte addresses, transferring 16 bits
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&cfg, false);
+        channel_config_set_write_increment(&cfg, true);
+
+        // Pace transfers based on availability of ADC samples
+        channel_config_set_dreq(&cfg, DREQ_ADC);
+        channel_config_set_chain_to(&cfg, c < ADC_CHANNEL_COUNT - 1 ? DMA_CHANNEL + c + 1 : DMA_CONTROL_CHANNEL);
+
+        // The sniffer adds up every reference sample as it's transferred, so the average costs no processing
+        if (c == 0) channel_config_set_sniff_enable(&cfg, true);
+
+        dma_channel_configure(DMA_CHANNEL + c, &cfg, NULL, &adc_hw->fifo, 1, false);
+    }
+
+    // The control channel writes the next trigger table entry to the multi channel trigger register
+    dma_channel_claim(DMA_CONTROL_CHANNEL);
+    dma_channel_config control_cfg = dma_channel_get_default_config(DMA_CONTROL_CHANNEL);
+    channel_config_set_transfer_data_size(&control_cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&control_cfg, true);
+    channel_config_set_write_increment(&control_cfg, false);
+    dma_channel_configure(DMA_CONTROL_CHANNEL, &control_cfg, &dma_hw->multi_channel_trigger, NULL, 1, false);
+
+    // The done channel saves the sniffer sum and raises the interrupt that ends the capture
+    dma_channel_claim(DMA_DONE_CHANNEL);
+    dma_channel_config done_cfg = dma_channel_get_default_config(DMA_DONE_CHANNEL);
+    channel_config_set_transfer_data_size(&done_cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&done_cfg, false);
+    channel_config_set_write_increment(&done_cfg, false);
+    dma_channel_configure(DMA_DONE_CHANNEL, &done_cfg, &dma_sniffed_sum, &dma_hw->sniff_data, 1, false);
+
+    dma_sniffer_enable(DMA_CHANNEL, DMA_SNIFF_CTRL_CALC_VALUE_SUM, true);
+
+    // Only one capture is in flight at a time, as they all share the same buffer
+    queue_init(&capture_queue, sizeof(capture_event_t), 1);
+
+    dma_channel_set_irq0_enabled(DMA_DONE_CHANNEL, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, capture_done_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
+
+    return true;
+}
+
+bool init_capture_buffers() {
+    // Space the conversions so that a whole number of them fits in one excitation period
+    adc_set_clkdiv((sampling_plan.adc_period_256ths - 256) / 256.0f);
+
+    // Release the buffers of the previous sampling plan, if any
+    if (sample_buffer != adc_capture_buffer) free(sample_buffer);
+    free(adc_capture_buffer);
+    free(dma_trigger_table);
+
+    // Allocate the buffer on memory, with a separate part for every channel of the round robin
+    adc_channel_length = sampling_plan.samples_per_period * CAPTURE_PERIODS;
+    adc_capture_buffer_size = ADC_CHANNEL_COUNT * adc_channel_length;
     adc_capture_buffer = calloc(adc_capture_buffer_size, sizeof(uint16_t));
     if (adc_capture_buffer == NULL) {
         printf("ERROR WHILE ALLOCATING MEMORY FOR CAPTURE_BUFFER!\n");
@@ -100,202 +772,2474 @@ bool init_adc() {
         return false;
     }
 
-    // Configure the DMA channel to read from ADC FIFO and write to capture buffer
-    dma_channel_configure(DMA_CHANNEL, &cfg, adc_capture_buffer, &adc_hw->fifo, adc_capture_buffer_size, false);
+    // The control channel restarts the round robin after each round, except after the last one
+    dma_trigger_table = calloc(adc_channel_length, sizeof(uint32_t));
+    if (dma_trigger_table == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR DMA TRIGGER TABLE!\n");
+
+        return false;
+    }
+    for (int i = 0; i < adc_channel_length; i++) {
+        dma_trigger_table[i] = i < adc_channel_length - 1 ? 1u << DMA_CHANNEL : 1u << DMA_DONE_CHANNEL;
+    }
+
+    // Without the filter the demodulators read the capture buffer directly
+    sample_channel_length = adc_channel_length / CIC_DECIMATION;
+    sample_buffer_size = adc_capture_buffer_size / CIC_DECIMATION;
+    if (CIC_DECIMATION == 1) {
+        sample_buffer = adc_capture_buffer;
+    } else {
+        sample_buffer = calloc(sample_buffer_size, sizeof(uint16_t));
+        if (sample_buffer == NULL) {
+            printf("ERROR WHILE ALLOCATING MEMORY FOR SAMPLE BUFFER!\n");
+
+            return false;
+        }
+    }
+
+    return true;
 }
 
-void start_adc_sampling() {
+void init_mux() {
+    for (int i = 0; i < MUX_SELECT_PIN_COUNT; i++) {
+        gpio_init(MUX_SELECT_BASE_PIN + i);
+        gpio_set_dir(MUX_SELECT_BASE_PIN + i, GPIO_OUT);
+        gpio_put(MUX_SELECT_BASE_PIN + i, false);
+    }
+}
+
+void select_mux_channel(uint mux_channel) {
+    if (MUX_SELECT_PIN_COUNT == 0) return;
+
+    for (int i = 0; i < MUX_SELECT_PIN_COUNT; i++) {
+        gpio_put(MUX_SELECT_BASE_PIN + i, (mux_channel >> i) & 1);
+    }
+
+    // Wait for the DUT and the filtering after the multiplexer to settle before capturing
+    sleep_us(MUX_SETTLING_US);
+}
+
+void __not_in_flash_func(start_adc_sampling)() {
     // ADC inputs are from 0-3 (GPIO 26-29)
     adc_select_input(REFERENCE_ADC_PIN - ADC_BASE_PIN);
 
-    // Reset the write address back to the start of the capture buffer
-    dma_channel_set_write_addr(DMA_CHANNEL, adc_capture_buffer, true);
+    // Reset the write addresses back to the start of each channel and the control channel back to the first round
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+        dma_channel_set_write_addr(DMA_CHANNEL + c, get_capture_channel(c), false);
+    }
+    dma_channel_set_read_addr(DMA_CONTROL_CHANNEL, dma_trigger_table, false);
+    dma_sniffer_set_data_accumulator(0);
 
-    // Start free-running sampling mode
+    // The reference channel waits for the first sample, then start free-running sampling mode. The PWM counters
+    // are read right before the conversions start, with the interrupts held off so that nothing can come in
+    // between and shift the phase the tracker takes from them. The timestamp only needs to be close, so it's
+    // read afterwards
+    dma_channel_start(DMA_CHANNEL);
+    uint32_t interrupts = save_and_disable_interrupts();
+    capture_start_pwm_count = pwm_get_counter(pwm_gpio_to_slice_num(PWM_PIN));
+    if (DUAL_TONE) capture_start_second_pwm_count = pwm_get_counter(pwm_gpio_to_slice_num(SECOND_PWM_PIN));
     adc_run(true);
+    restore_interrupts(interrupts);
+    capture_start_us = time_us_64();
+}
 
-    // Once DMA finishes, stop any new conversions from starting, and clean up
-    // the FIFO in case the ADC was still mid-conversion
-    dma_channel_wait_for_finish_blocking(DMA_CHANNEL);
-    adc_run(false);
+// Set by the trigger interrupt once it has started the first capture of a measurement, with the time of the edge
+PROCESSING_STATE volatile bool capture_triggered = false;
+PROCESSING_STATE volatile uint64_t trigger_us;
+
+void __not_in_flash_func(trigger_handler)() {
+    // Timestamp the edge and start the capture before anything else, as the interrupt is the only latency
+    uint64_t edge_us = time_us_64();
+    start_adc_sampling();
+
+    // Single shot, the trigger is armed again for the next measurement
+    gpio_set_irq_enabled(TRIGGER_PIN, TRIGGER_EDGE, false);
+    gpio_acknowledge_irq(TRIGGER_PIN, TRIGGER_EDGE);
+
+    trigger_us = edge_us;
+    capture_triggered = true;
+}
+
+void init_trigger() {
+    gpio_init(TRIGGER_PIN);
+    gpio_set_dir(TRIGGER_PIN, GPIO_IN);
+
+    // A raw handler skips the callback dispatch, and the highest priority keeps USB from delaying it
+    gpio_add_raw_irq_handler(TRIGGER_PIN, trigger_handler);
+    irq_set_priority(IO_IRQ_BANK0, PICO_HIGHEST_IRQ_PRIORITY);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+void arm_trigger() {
+    // Discard any edge from before arming
+    gpio_acknowledge_irq(TRIGGER_PIN, TRIGGER_EDGE);
+    gpio_set_irq_enabled(TRIGGER_PIN, TRIGGER_EDGE, true);
+}
+
+void __not_in_flash_func(read_temperature_sensor)() {
+    if (!TEMPERATURE_SENSING) return;
+
+    // A single conversion while the ADC is idle between captures, after any conversion the capture left running.
+    // It also lands in the FIFO, which is drained before the round robin goes back to the capture inputs
+    while (!(adc_hw->cs & ADC_CS_READY_BITS)) tight_loop_contents();
+    adc_set_round_robin(0);
+    adc_select_input(TEMPERATURE_ADC_INPUT);
+    capture_temperature_code = adc_read();
+    adc_fifo_drain();
+    adc_set_round_robin(get_round_robin_mask());
+}
+
+void __not_in_flash_func(wait_for_adc_sampling)() {
+    // Sleep until the DMA interrupt publishes the capture. The interrupts are disabled while checking the
+    // queue, so that a capture completing right before the sleep still wakes the processor up. USB is
+    // serviced by its own interrupts, which also wake it up
+    capture_event_t event;
+    while (!queue_try_remove(&capture_queue, &event)) {
+        uint32_t interrupts = save_and_disable_interrupts();
+        if (queue_is_empty(&capture_queue)) __wfi();
+        restore_interrupts(interrupts);
+    }
+
+    capture_latency_cycles = (event.done_count - read_cycle_counter()) & 0x00FFFFFF;
+    capture_reference_sum = event.reference_sum;
+
+    // Clean up the FIFO in case the ADC was still mid-conversion
     adc_fifo_drain();
+
+    read_temperature_sensor();
 }
 
-int* get_input_samples(int input_iterations) {
-    // We should guarantee that the number of samples is even (and rounded down) since we're sampling two inputs
-    uint rounded_size = floor(adc_capture_buffer_size / 2) * 2;
+void __not_in_flash_func(decimate_capture)() {
+    uint channel_samples = adc_channel_length;
 
-    // Calculate the interval between one sample and another
-    double sampling_frequency_us = 96.0 * 1000000 / ADC_FREQ_HZ;
-    double input_sample_interval_us = 1000000 / (INPUT_SAMPLE_SIZE * PWM_FREQ);
-    double sample_index_spacing =  input_sample_interval_us / sampling_frequency_us;
+    // The first outputs need CIC_ORDER * (CIC_DECIMATION - 1) samples of history, so start the filter that many
+    // (rounded up to whole decimation steps) before the beginning. The capture holds whole periods, so the
+    // samples at the end of the buffer are exactly the ones that came before the first sample
+    int warmup = CIC_ORDER * CIC_DECIMATION;
 
-    // Allocate the memory for the samples
-    int* input_samples = calloc(INPUT_SAMPLE_SIZE, sizeof(int));
-    if (input_samples == NULL) {
-        printf("ERROR WHILE ALLOCATING MEMORY FOR INPUT SAMPLES BUFFER!\n");
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+        uint16_t* capture_samples = get_capture_channel(c);
+        uint16_t* output_samples = get_sample_channel(c);
 
-        return NULL;
+        // Wrapping arithmetic keeps the output exact as long as it fits in 32 bits
+        uint32_t integrators[CIC_ORDER] = { 0 };
+        uint32_t comb_delays[CIC_ORDER] = { 0 };
+
+        for (int n = -warmup; n < (int) channel_samples; n++) {
+            uint index = n < 0 ? n + channel_samples : n;
+            uint32_t value = adc_correction_table[capture_samples[index]];
+
+            for (int s = 0; s < CIC_ORDER; s++) {
+                integrators[s] += value;
+                value = integrators[s];
+            }
+
+            // The combs run at the decimated rate, once every CIC_DECIMATION input samples
+            if ((n & (CIC_DECIMATION - 1)) != CIC_DECIMATION - 1) continue;
+
+            for (int s = 0; s < CIC_ORDER; s++) {
+                uint32_t previous = comb_delays[s];
+                comb_delays[s] = value;
+                value -= previous;
+            }
+
+            // Remove the filter gain (CIC_DECIMATION ^ CIC_ORDER) and the correction fraction except for the
+            // kept fraction bits
+            if (n >= 0) {
+                output_samples[n >> CIC_DECIMATION_BITS] =
+                    value >> (CIC_ORDER * CIC_DECIMATION_BITS + ADC_CORRECTION_FRACTION_BITS - CIC_FRACTION_BITS);
+            }
+        }
+    }
+}
+
+void __not_in_flash_func(correct_capture)() {
+    // Without the filter the samples have no fraction bits, so the corrected codes are rounded in place
+    for (int i = 0; i < adc_capture_buffer_size; i++) {
+        uint16_t value = adc_correction_table[adc_capture_buffer[i]];
+        adc_capture_buffer[i] = (value + (1 << (ADC_CORRECTION_FRACTION_BITS - 1))) >> ADC_CORRECTION_FRACTION_BITS;
     }
+}
+
+double get_cic_gain(double harmonic_order) {
+    if (CIC_DECIMATION == 1) return 1;
+
+    // Gain of the filter relative to DC, at the given multiple of the excitation frequency
+    double normalized_frequency = harmonic_order / sampling_plan.samples_per_period;
+    double gain = sin(M_PI * normalized_frequency * CIC_DECIMATION) / (CIC_DECIMATION * sin(M_PI * normalized_frequency));
+
+    return pow(gain, CIC_ORDER);
+}
+
+// Skips the progress and the intermediate results, when measuring for a part handler
+PROCESSING_STATE bool quiet_output = false;
+
+// Logging measurements while no host is connected, which stop as soon as one connects
+PROCESSING_STATE bool headless = false;
+
+bool measurement_interrupted() {
+    return headless && tud_cdc_connected();
+}
+
+void print_progress(int iteration, int total_iterations) {
+    if (quiet_output) return;
 
     // The size is 3 bytes more than the length (considering the chars '[', ']' and '\0')
-    uint indicator_length = 30;
-    uint indicator_size = indicator_length + 3;
+    const uint indicator_length = 30;
+    const uint indicator_size = indicator_length + 3;
     char progress_indicator[indicator_size];
+
+    // Calculate the loop progress to print on the screen
+    uint progress = indicator_length * (iteration + 1) / total_iterations;
+    uint percentage = 100 * progress / indicator_length;
     for (int i = 0; i < indicator_size; i++) {
         if (i == 0) progress_indicator[i] = '[';
         else if (i == (indicator_size - 2)) progress_indicator[i] = ']';
         else if (i == (indicator_size - 1)) progress_indicator[i] = '\0';
+        else if (i <= progress) progress_indicator[i] = '=';
         else progress_indicator[i] = ' ';
     }
+    printf("\rMeasuring: %s %d%%", progress_indicator, percentage);
+}
 
-    // Instead of getting the samples in one period, average between multiple ones to remove noise
-    for (int i = 0; i < input_iterations; i++) {
-        start_adc_sampling();
+void __not_in_flash_func(capture_samples)(uint iteration, uint total_iterations) {
+    // A triggered measurement had its first capture started by the trigger interrupt
+    if (capture_triggered) capture_triggered = false;
+    else start_adc_sampling();
 
-        // Get the average value of the reference and input values
-        uint accumulator_reference = 0;
-        uint accumulator_input = 0;
-        for (int i = 0; i < rounded_size; i += 2) {
-            accumulator_reference += adc_capture_buffer[i];
-            accumulator_input += adc_capture_buffer[i + 1];
-        }
-        uint16_t average_ref = round(accumulator_reference / (rounded_size / 2));
-        uint16_t average_input = round(accumulator_input / (rounded_size / 2));
-
-        // Initialize the variable containing the index of the first reference sample after zero crossing as -1 (UINT_MAX)
-        uint zero_index = -1;
-
-        uint16_t previous_reference_value = 0;
-        // Initializes the current reference value as the last reference sample
-        uint16_t current_reference_value = adc_capture_buffer[rounded_size - 2];
-        for (int i = 0; i < rounded_size; i += 2) {
-            // Update the loop values
-            previous_reference_value = current_reference_value;
-            current_reference_value = adc_capture_buffer[i];
-
-            // If the previous value is under the average and the current is over, zero crossing has ocurred
-            if (previous_reference_value < average_ref && current_reference_value >= average_ref) {
-                zero_index = i;
-                break;
-            }
-        }
+    // Update the progress while the DMA fills the buffer instead of after the processing
+    print_progress(iteration, total_iterations);
 
-        // If the index of the first reference sample is still as UINT_MAX, we couldn't find the zero crossing
-        if (zero_index == -1) {
-            printf("ERROR WHILE SEARCHING FOR ZERO CROSSING ON REFERENCE!\n");
-            continue;
-        }
+    wait_for_adc_sampling();
 
-        // Use modular arithmetic to acquire the samples without overflow, making sure we're getting an input (odd) sample
-        double sample = zero_index + 1;
-        for (int j = 0; j < INPUT_SAMPLE_SIZE; j++) {
-            uint nearest_odd_sample = (uint) sample % 2 != 0 ? sample : (sample + 1);
-            input_samples[j] += (adc_capture_buffer[nearest_odd_sample] - average_input);
+    if (CIC_DECIMATION > 1) decimate_capture();
+    else correct_capture();
+}
+
+uint16_t get_reference_average() {
+    // The sniffer summed the raw reference samples, and the CIC filter has a DC gain of 2^SAMPLE_FRACTION_BITS
+    return ((uint64_t) capture_reference_sum << SAMPLE_FRACTION_BITS) / adc_channel_length;
+}
+
+void accumulate_temperature() {
+    if (!TEMPERATURE_SENSING) return;
+
+    // The temperature changes far slower than a measurement, so a single conversion per capture averages out as
+    // well as sampling it all along
+    temperature_accumulator += capture_temperature_code;
+    temperature_sample_count++;
+}
+
+void reset_temperature() {
+    temperature_accumulator = 0;
+    temperature_sample_count = 0;
+}
+
+double get_temperature() {
+    if (temperature_sample_count == 0) return NAN;
+
+    // Conversion from the RP2040 datasheet, the sensor reads 0.706 V at 27 C and drops 1.721 mV per degree
+    const double conversion_factor = 3.3 / (1 << 12);
+    double voltage = (double) temperature_accumulator / temperature_sample_count * conversion_factor;
+
+    return 27 - (voltage - 0.706) / 0.001721;
+}
+
+double get_compensated_ri(double temperature_delta) {
+    return RI * (1 + RI_TEMPCO_PPM_PER_C * 1e-6 * temperature_delta);
+}
+
+double complex get_compensated_open_voltage(double complex open_voltage, double temperature_delta) {
+    return open_voltage * (1 + OPEN_VOLTAGE_TEMPCO_PPM_PER_C * 1e-6 * temperature_delta);
+}
 
-            sample = fmod(sample + sample_index_spacing, rounded_size);
+uint __not_in_flash_func(find_zero_crossing)(uint16_t average_ref) {
+    uint16_t* reference_samples = get_sample_channel(0);
+    // A reference averaging less than the hysteresis arms on its lowest samples instead of never arming
+    int arm_threshold = (int) average_ref - (ZERO_CROSSING_HYSTERESIS << SAMPLE_FRACTION_BITS);
+    if (arm_threshold < 0) arm_threshold = 0;
+
+    // Initialize the variable containing the position of the zero crossing as -1 (UINT_MAX)
+    uint crossing = -1;
+
+    // Go through the buffer twice, since the crossing after the reference first goes under the hysteresis band may
+    // only come after wrapping around (the buffer holds whole periods, so the wraparound is continuous)
+    bool armed = false;
+    uint16_t previous_reference_value = 0;
+    // Initializes the current reference value as the last reference sample
+    uint16_t current_reference_value = reference_samples[sample_channel_length - 1];
+    for (int i = 0; i < 2 * sample_channel_length; i++) {
+        // Update the loop values
+        previous_reference_value = current_reference_value;
+        current_reference_value = reference_samples[i % sample_channel_length];
+
+        if (current_reference_value <= arm_threshold) armed = true;
+
+        // Once armed, the first value at or over the average is right after the crossing (the previous one is
+        // still under it), so interpolate linearly between both to find where exactly it happened
+        if (armed && current_reference_value >= average_ref) {
+            // A reference that only touches the average without going under it (like a flat one at 0) has no
+            // crossing, and nothing to interpolate between
+            if (previous_reference_value >= average_ref) break;
+
+            uint previous_index = (i + sample_channel_length - 1) % sample_channel_length;
+            uint fraction = ((uint) (average_ref - previous_reference_value) << CROSSING_FRACTION_BITS)
+                / (current_reference_value - previous_reference_value);
+
+            crossing = ((previous_index << CROSSING_FRACTION_BITS) + fraction) % (sample_channel_length << CROSSING_FRACTION_BITS);
+            break;
         }
+    }
+
+    return crossing;
+}
+
+double start_reference_sampling(uint sample_rate_hz) {
+    // Sample only the reference, reading the FIFO directly without the DMA
+    uint adc_period_cycles = ADC_FREQ_HZ / sample_rate_hz;
+    adc_set_round_robin(0);
+    adc_select_input(REFERENCE_ADC_PIN - ADC_BASE_PIN);
+    adc_set_clkdiv(adc_period_cycles - 1);
+    adc_fifo_drain();
+    adc_run(true);
+
+    // The actual sample rate
+    return (double) ADC_FREQ_HZ / adc_period_cycles;
+}
+
+void stop_reference_sampling() {
+    adc_run(false);
+    adc_fifo_drain();
+
+    // Go back to the capture setup, if there's one already
+    adc_set_round_robin(get_round_robin_mask());
+    if (sampling_plan.adc_period_256ths != 0) adc_set_clkdiv((sampling_plan.adc_period_256ths - 256) / 256.0f);
+}
+
+double measure_reference_frequency() {
+    double sample_rate_hz = start_reference_sampling(EXTERNAL_REFERENCE_SAMPLE_RATE_HZ);
+
+    uint16_t min_value = UINT16_MAX, max_value = 0;
+    for (int i = 0; i < EXTERNAL_REFERENCE_RANGE_SAMPLES; i++) {
+        uint16_t value = adc_fifo_get_blocking();
+        if (value < min_value) min_value = value;
+        if (value > max_value) max_value = value;
+    }
+
+    // Time the rising crossings of the middle level, with the same hysteresis and interpolation as the
+    // crossing search but a wider band, since the range is known
+    uint16_t middle = (min_value + max_value) / 2;
+    uint16_t hysteresis = (max_value - min_value) / 8;
+    if (hysteresis < ZERO_CROSSING_HYSTERESIS) hysteresis = ZERO_CROSSING_HYSTERESIS;
+
+    bool armed = false;
+    uint crossing_count = 0;
+    double first_crossing = 0, last_crossing = 0;
+    uint16_t previous_value = 0, current_value = adc_fifo_get_blocking();
+    for (int i = 1; i < EXTERNAL_REFERENCE_WINDOW_SAMPLES; i++) {
+        previous_value = current_value;
+        current_value = adc_fifo_get_blocking();
+
+        if (current_value + hysteresis < middle) armed = true;
 
-        // Calculate the loop progress to print on the screen
-        uint progress = indicator_length * (i + 1) / input_iterations;
-        uint percentage = 100 * progress / indicator_length;
-        for (int j = 1; j <= progress; j++) {
-            progress_indicator[j] = '=';
+        if (armed && current_value >= middle) {
+            last_crossing = i - 1 + (double) (middle - previous_value) / (current_value - previous_value);
+            if (crossing_count == 0) first_crossing = last_crossing;
+
+            crossing_count++;
+            armed = false;
         }
-        printf("\rMeasuring: %s %d%%", progress_indicator, percentage);
     }
 
-    printf("\n");
+    stop_reference_sampling();
 
-    // Get the average of the acquired samples
-    for (int i = 0; i < INPUT_SAMPLE_SIZE; i++) {
-        input_samples[i] = round(input_samples[i] / input_iterations);
+    if (crossing_count < 2) {
+        printf("ERROR WHILE MEASURING THE EXTERNAL REFERENCE FREQUENCY!\n");
+
+        return 0;
     }
-    
-    return input_samples;
+
+    return (crossing_count - 1) * sample_rate_hz / (last_crossing - first_crossing);
 }
 
-void print_samples(int* samples) {
-    const float conversion_factor = 3.3f / (1 << 12);
+void load_adc_correction() {
+    const adc_correction_t* stored = (const adc_correction_t*) (XIP_BASE + ADC_CORRECTION_FLASH_OFFSET);
+
+    if (stored->magic == ADC_CORRECTION_MAGIC && stored->fraction_bits == ADC_CORRECTION_FRACTION_BITS) {
+        memcpy(adc_correction_table, stored->table, sizeof(adc_correction_table));
+        return;
+    }
 
-    printf("Samples: [");
-    for (int i = 0; i < INPUT_SAMPLE_SIZE; i++) {
-        printf(" %lf", samples[i] * conversion_factor);
+    // Without a calibration every code stays as it is
+    for (int i = 0; i < (1 << 12); i++) {
+        adc_correction_table[i] = i << ADC_CORRECTION_FRACTION_BITS;
     }
-    printf(" ]\n");
 }
 
-double complex get_voltage(int* samples) {
-    double quadrature = samples[0] - samples[2];
-    double inphase = samples[1] - samples[3];
+bool calibrate_adc_correction() {
+    printf("\nApply a slow ramp covering the whole ADC range to the reference input and press Enter...\n");
+    getchar();
 
-    return (inphase + quadrature * I);
-}
+    uint32_t* histogram = calloc(1 << 12, sizeof(uint32_t));
+    if (histogram == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR ADC HISTOGRAM!\n");
 
-double complex calculate_result(int* open_circuit_samples, int* dut_samples) {
-    double complex dut_open_voltage = get_voltage(open_circuit_samples);
-    double complex dut_short_voltage = 0 + 0 * I; // Considering a perfect short
-    double complex dut_voltage = get_voltage(dut_samples);
+        return false;
+    }
 
-    double complex result = (RI * RS * (dut_voltage - dut_short_voltage)) / (RI + RS * (dut_open_voltage - dut_voltage));
+    // The FIFO only holds a few samples, so the progress is printed between blocks with the sampling stopped. The
+    // ramp moving on meanwhile doesn't change how the codes are distributed
+    for (int b = 0; b < ADC_CALIBRATION_BLOCKS; b++) {
+        start_reference_sampling(ADC_CALIBRATION_SAMPLE_RATE_HZ);
+        for (int i = 0; i < ADC_CALIBRATION_SAMPLES / ADC_CALIBRATION_BLOCKS; i++) {
+            histogram[adc_fifo_get_blocking()]++;
+        }
+        stop_reference_sampling();
 
-    return result;
-}
+        print_progress(b, ADC_CALIBRATION_BLOCKS);
+    }
+    printf("\n");
 
-void print_result(double complex result, char component) {
-    double real = creal(result);
-    double imag = cimag(result);
+    // The first and last codes reached also collect everything beyond them, so only the ones in between are used
+    uint first_code = 0, last_code = (1 << 12) - 1;
+    while (first_code < last_code && histogram[first_code] == 0) first_code++;
+    while (last_code > first_code && histogram[last_code] == 0) last_code--;
 
-    if (component == 'C' || component == 'c') {
-        float capacitor_value = -1 * 1000000000 / (2 * M_PI * PWM_FREQ * imag);
-        printf("Capacitor value: %f nF\n", capacitor_value);
-    } else {
-        printf("Resistor value: %lf\n", real);
+    if (last_code - first_code < ADC_CALIBRATION_MIN_CODES) {
+        printf("ERROR: THE RAMP ONLY COVERS CODES %u TO %u!\n", first_code, last_code);
+
+        free(histogram);
+        return false;
     }
-}
 
-int main()
-{
-    // Overclocks the device
-    set_sys_clock_hz(CLOCK_FREQ_HZ, true);
+    uint64_t total_count = 0;
+    for (int k = first_code + 1; k < last_code; k++) {
+        total_count += histogram[k];
+    }
+    double average_count = (double) total_count / (last_code - first_code - 1);
 
-    // Initializes the USB stuff
-    stdio_init_all();
+    // With a ramp every code is hit in proportion to its width, so the input at the center of each code comes
+    // from the counts of the codes under it, taking the first one used as ideal
+    adc_correction_t* correction = calloc(1, ADC_CORRECTION_FLASH_SIZE);
+    if (correction == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR ADC CORRECTION!\n");
 
-    init_pwm();
+        free(histogram);
+        return false;
+    }
 
-    bool success = init_adc();
-    if (!success) return 1;
+    double max_dnl = 0, max_inl = 0;
+    double first_center = 0, last_center = 0;
+    uint64_t count_below = 0;
+    for (int k = first_code + 1; k < last_code; k++) {
+        double center = first_code + 0.5 + (count_below + histogram[k] / 2.0) / average_count;
+        count_below += histogram[k];
 
-    // Wait for USB connection
-    while (!tud_cdc_connected()) sleep_ms(100);
+        if (k == first_code + 1) first_center = center;
+        last_center = center;
 
-    // Clear the screen
-    printf("\e[1;1H\e[2J");
+        double dnl = histogram[k] / average_count - 1;
+        if (fabs(dnl) > fabs(max_dnl)) max_dnl = dnl;
+        if (fabs(center - k) > fabs(max_inl)) max_inl = center - k;
 
-    printf("\n-------------------------------------------------\n");
-    printf("Set up the DUT as open circuit and press Enter...\n");
-    getchar();
+        correction->table[k] = round(center * (1 << ADC_CORRECTION_FRACTION_BITS));
+    }
 
-    int* open_circuit_samples = get_input_samples(8192);
-    if (open_circuit_samples == NULL) return 1;
-    print_samples(open_circuit_samples);
+    // The codes outside of the ramp keep the offset of the nearest measured one, without going under zero
+    for (int k = 0; k <= first_code; k++) {
+        double value = k + first_center - (first_code + 1);
+        correction->table[k] = value > 0 ? round(value * (1 << ADC_CORRECTION_FRACTION_BITS)) : 0;
+    }
+    for (int k = last_code; k < (1 << 12); k++) {
+        correction->table[k] = round((k + last_center - (last_code - 1)) * (1 << ADC_CORRECTION_FRACTION_BITS));
+    }
 
-    printf("\nSet up the DUT as the impedance to be measured...\n");
-    printf("When configured, input R for resistance measurement and C for capacitance...\n");
-    char component = getchar();
+    free(histogram);
 
-    while (true) {
-        int* dut_samples = get_input_samples(8192);
-        if (dut_samples == NULL) return 1;
-        print_samples(dut_samples);
+    printf("ADC codes %u to %u, max DNL %+.2lf LSB, max INL %+.2lf LSB\n", first_code, last_code, max_dnl, max_inl);
 
-        double complex result = calculate_result(open_circuit_samples, dut_samples);
-        print_result(result, component);
+    correction->magic = ADC_CORRECTION_MAGIC;
+    correction->fraction_bits = ADC_CORRECTION_FRACTION_BITS;
 
-        printf("\nTo measure again, input R for resistance measurement and C for capacitance...\n");
-        component = getchar();
+    // The flash can't be read while it's being written, so nothing else may run from it in the meantime
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(ADC_CORRECTION_FLASH_OFFSET, ADC_CORRECTION_FLASH_SIZE);
+    flash_range_program(ADC_CORRECTION_FLASH_OFFSET, (const uint8_t*) correction, ADC_CORRECTION_FLASH_SIZE);
+    restore_interrupts(interrupts);
+
+    free(correction);
+
+    load_adc_correction();
+
+    return true;
+}
+
+const measurement_profile_t* get_measurement_profile() {
+    return &measurement_profiles[measurement_profile_index];
+}
+
+demodulator_t get_profile_demodulator(const measurement_profile_t* profile) {
+    // The tones are told apart by correlating whole captures, so two tones always take the harmonic demodulator
+    return DUAL_TONE ? DEMODULATOR_HARMONIC : profile->demodulator;
+}
+
+demodulator_t get_demodulator() {
+    return get_profile_demodulator(get_measurement_profile());
+}
+
+void load_measurement_profile() {
+    const stored_profile_t* stored = (const stored_profile_t*) (XIP_BASE + PROFILE_FLASH_OFFSET);
+    if (stored->magic != PROFILE_MAGIC) return;
+
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        if (strncmp(stored->name, measurement_profiles[p].name, sizeof(stored->name)) == 0) measurement_profile_index = p;
+    }
+
+    // Profiles stored before the bin limits were leave the erased flash after the name
+    if (stored->bin_limits_magic != BIN_LIMITS_MAGIC || stored->bin_count == 0 || stored->bin_count > BIN_MAX_COUNT) return;
+
+    bin_count = stored->bin_count;
+    memcpy(bin_limits, stored->bin_limits, sizeof(bin_limits));
+}
+
+// Saves the profile together with the bin limits, as they share the flash sector
+void save_measurement_profile() {
+    // The flash is programmed in whole pages
+    uint8_t page[FLASH_PAGE_SIZE] = { 0 };
+    stored_profile_t* stored = (stored_profile_t*) page;
+    stored->magic = PROFILE_MAGIC;
+    strncpy(stored->name, get_measurement_profile()->name, sizeof(stored->name) - 1);
+    stored->bin_limits_magic = BIN_LIMITS_MAGIC;
+    stored->bin_count = bin_count;
+    memcpy(stored->bin_limits, bin_limits, sizeof(bin_limits));
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(PROFILE_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(PROFILE_FLASH_OFFSET, page, FLASH_PAGE_SIZE);
+    restore_interrupts(interrupts);
+}
+
+int64_t __not_in_flash_func(correlate)(const int16_t* values, const int16_t* table, uint count) {
+    int64_t accumulator = 0;
+
+#if DSP_KERNELS
+    // Dual 16-bit multiply-accumulate into 64 bits, on pairs of consecutive samples packed in one word
+    for (int i = 0; i < count; i += 2) {
+        int16x2_t packed_values, packed_table;
+        memcpy(&packed_values, &values[i], sizeof(int16x2_t));
+        memcpy(&packed_table, &table[i], sizeof(int16x2_t));
+
+        accumulator = __smlald(packed_values, packed_table, accumulator);
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        accumulator += values[i] * table[i];
+    }
+#endif
+
+    return accumulator;
+}
+
+// The tracker runs on every capture, so it works in single precision, which the FPU of the Cortex-M33 does in
+// hardware (double precision would be in software on both chips)
+typedef struct {
+    // Phase of the reference fundamental when the excitation PWM counter wraps, in periods
+    float phase;
+    // Frequency of the reference minus the excitation frequency
+    float frequency_offset_hz;
+    uint64_t last_update_us;
+    bool acquired;
+    bool locked;
+    // Consecutive captures under the lock threshold, and over the unlock threshold or without a usable reference
+    uint lock_count;
+    uint miss_count;
+    // Phase errors while locked since the last reset, in periods
+    float error_square_sum;
+    uint error_count;
+} phase_tracker_t;
+
+PROCESSING_STATE phase_tracker_t phase_tracker;
+
+// One period of the sine and cosine of the fundamental, to measure the reference phase
+PROCESSING_STATE int16_t* reference_sine_table;
+PROCESSING_STATE int16_t* reference_cosine_table;
+
+bool init_phase_tracker() {
+    uint samples_per_period = sampling_plan.decimated_samples_per_period;
+
+    free(reference_sine_table);
+    free(reference_cosine_table);
+
+    reference_sine_table = calloc(samples_per_period, sizeof(int16_t));
+    reference_cosine_table = calloc(samples_per_period, sizeof(int16_t));
+    if (reference_sine_table == NULL || reference_cosine_table == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR PHASE TRACKER TABLES!\n");
+
+        return false;
+    }
+
+    for (int i = 0; i < samples_per_period; i++) {
+        double phase = 2 * M_PI * i / samples_per_period;
+        reference_sine_table[i] = round(sin(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+        reference_cosine_table[i] = round(cos(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+    }
+
+    phase_tracker = (phase_tracker_t) { 0 };
+
+    return true;
+}
+
+void reset_phase_tracker_statistics() {
+    phase_tracker.error_square_sum = 0;
+    phase_tracker.error_count = 0;
+}
+
+float wrap_phase(float phase) {
+    // Wraps a phase in periods to [-0.5, 0.5)
+    return phase - floorf(phase + 0.5f);
+}
+
+float get_capture_phase() {
+    float first_phase = (float) capture_start_pwm_count / (sampling_plan.pwm_wrap + 1);
+    if (!DUAL_TONE) return first_phase;
+
+    // Both tones only line up again every DENOMINATOR periods of the first one, so find which of those periods
+    // the capture started in from the phase of the second tone
+    float second_phase = (float) capture_start_second_pwm_count / (sampling_plan.second_pwm_wrap + 1);
+    uint best_period = 0;
+    float best_error = 1;
+    for (int p = 0; p < SECOND_TONE_DENOMINATOR; p++) {
+        float error = fabsf(wrap_phase((first_phase + p) * SECOND_TONE_NUMERATOR / SECOND_TONE_DENOMINATOR - second_phase));
+        if (error < best_error) {
+            best_error = error;
+            best_period = p;
+        }
+    }
+
+    return first_phase + best_period;
+}
+
+uint __not_in_flash_func(track_reference_phase)() {
+    uint samples_per_period = sampling_plan.decimated_samples_per_period;
+    uint16_t* reference_samples = get_sample_channel(0);
+
+    // Correlate the whole reference with the fundamental, which averages out far more noise than looking at the
+    // samples around one crossing. The samples fit in 15 bits, so the signed kernel can take them as they are,
+    // and the tables add up to zero over a period so the reference average drops out
+    int64_t sine_sum = 0, cosine_sum = 0;
+    for (int p = 0; p < CAPTURE_PERIODS; p++) {
+        const int16_t* period_samples = (const int16_t*) reference_samples + p * samples_per_period;
+
+        sine_sum += correlate(period_samples, reference_sine_table, samples_per_period);
+        cosine_sum += correlate(period_samples, reference_cosine_table, samples_per_period);
+    }
+
+    float amplitude = 2.0f * hypotf(sine_sum, cosine_sum) / ((float) samples_per_period * CAPTURE_PERIODS
+        * (1 << SINE_TABLE_FRACTION_BITS) * (1 << SAMPLE_FRACTION_BITS));
+    bool usable = amplitude >= PHASE_TRACKER_MIN_AMPLITUDE;
+
+    // Phase of the excitation when the capture started, and so the reference phase at the PWM wrap. Each capture
+    // starts at an arbitrary point of the period, but the PWM counter tells where
+    float capture_phase = get_capture_phase();
+    float measured_phase = atan2f(cosine_sum, sine_sum) / (2 * (float) M_PI) - capture_phase;
+
+    // With the PWM as the reference the offset stays 0, so the prediction holds over any gap. An external one
+    // drifts further over a long gap than its estimated offset can be trusted to predict
+    uint64_t elapsed_us = capture_start_us - phase_tracker.last_update_us;
+    if (EXTERNAL_REFERENCE && phase_tracker.acquired && elapsed_us > PHASE_TRACKER_MAX_GAP_US) {
+        phase_tracker.acquired = false;
+        phase_tracker.locked = false;
+    }
+
+    float elapsed = elapsed_us * 1e-6f;
+    float predicted_phase = phase_tracker.phase + phase_tracker.frequency_offset_hz * elapsed;
+    float error = wrap_phase(measured_phase - predicted_phase);
+
+    if (phase_tracker.acquired) {
+        if (!usable || fabsf(error) > PHASE_TRACKER_UNLOCK_THRESHOLD) phase_tracker.miss_count++;
+        else phase_tracker.miss_count = 0;
+
+        if (usable && fabsf(error) < PHASE_TRACKER_LOCK_THRESHOLD) phase_tracker.lock_count++;
+        else phase_tracker.lock_count = 0;
+
+        if (phase_tracker.miss_count >= PHASE_TRACKER_UNLOCK_CAPTURES) {
+            if (phase_tracker.locked) printf("\nLOST LOCK ON REFERENCE!\n");
+            phase_tracker.acquired = false;
+            phase_tracker.locked = false;
+            phase_tracker.frequency_offset_hz = 0;
+        } else if (phase_tracker.lock_count >= PHASE_TRACKER_LOCK_CAPTURES) {
+            phase_tracker.locked = true;
+        }
+    }
+
+    if (!phase_tracker.acquired) {
+        // Without a previous estimate the reference has to be usable to start tracking from the measurement
+        if (!usable) return -1;
+
+        // The offset outlives a gap, but not a lost lock
+        phase_tracker = (phase_tracker_t) {
+            .phase = measured_phase,
+            .frequency_offset_hz = phase_tracker.frequency_offset_hz,
+            .error_square_sum = phase_tracker.error_square_sum,
+            .error_count = phase_tracker.error_count,
+            .acquired = true
+        };
+    } else if (usable) {
+        // Follow the measurement closely while acquiring, and average out the noise once locked
+        float gain = phase_tracker.locked ? PHASE_TRACKER_PHASE_GAIN : PHASE_TRACKER_ACQUISITION_GAIN;
+        phase_tracker.phase = predicted_phase + gain * error;
+        if (EXTERNAL_REFERENCE && elapsed > 0) phase_tracker.frequency_offset_hz += PHASE_TRACKER_FREQUENCY_GAIN * error / elapsed;
+
+        if (phase_tracker.locked) {
+            phase_tracker.error_square_sum += error * error;
+            phase_tracker.error_count++;
+        }
+    } else if (phase_tracker.locked) {
+        // Coast on the prediction while the reference is too noisy to measure
+        phase_tracker.phase = predicted_phase;
+    } else {
+        return -1;
+    }
+
+    phase_tracker.phase -= floorf(phase_tracker.phase);
+    phase_tracker.last_update_us = capture_start_us;
+
+    // The rising crossing of the fundamental is where its phase is zero. With two tones it has to be the one where
+    // both line up, so the crossing is looked for over the whole capture window
+    float crossing_phase = -(capture_phase + phase_tracker.phase);
+    crossing_phase -= floorf(crossing_phase / CAPTURE_PERIODS) * CAPTURE_PERIODS;
+    if (!DUAL_TONE) crossing_phase -= floorf(crossing_phase);
+
+    uint crossing = roundf(crossing_phase * samples_per_period * (1 << CROSSING_FRACTION_BITS));
+    return crossing % (sample_channel_length << CROSSING_FRACTION_BITS);
+}
+
+void print_phase_tracker() {
+    double rms_error = phase_tracker.error_count > 0 ? sqrt(phase_tracker.error_square_sum / phase_tracker.error_count) : 0;
+
+    printf("Reference %s at %.4lf Hz, phase error %.3lf deg RMS\n", phase_tracker.locked ? "locked" : "unlocked",
+        sampling_plan.frequency_hz + phase_tracker.frequency_offset_hz, rms_error * 360);
+}
+
+double get_reference_frequency() {
+    // The tracker follows any difference between the reference and the planned frequency
+    return sampling_plan.frequency_hz + (PHASE_TRACKING ? phase_tracker.frequency_offset_hz : 0);
+}
+
+uint get_reference_crossing() {
+    if (PHASE_TRACKING) return track_reference_phase();
+
+    return find_zero_crossing(get_reference_average());
+}
+
+typedef struct {
+    // Captures in each block, and the blocks started so far
+    uint block_size;
+    uint block_count;
+    // Sums of the real and imaginary parts of the captures of every block, and how many captures each one holds
+    int64_t block_sums[AVERAGE_BLOCK_COUNT][2];
+    uint block_fills[AVERAGE_BLOCK_COUNT];
+} robust_average_t;
+
+// Outlier blocks found by every average since the last reset, out of all the blocks
+PROCESSING_STATE uint outlier_block_count;
+PROCESSING_STATE uint total_block_count;
+
+void reset_outlier_statistics() {
+    outlier_block_count = 0;
+    total_block_count = 0;
+}
+
+void init_robust_average(robust_average_t* average, uint value_count) {
+    average->block_size = (value_count + AVERAGE_BLOCK_COUNT - 1) / AVERAGE_BLOCK_COUNT;
+    if (average->block_size == 0) average->block_size = 1;
+
+    average->block_count = 0;
+}
+
+void add_robust_average(robust_average_t* average, int64_t real, int64_t imaginary) {
+    // Start a new block once the current one is full (the last one takes whatever is left)
+    uint block = average->block_count - 1;
+    if (average->block_count == 0
+        || (average->block_fills[block] == average->block_size && average->block_count < AVERAGE_BLOCK_COUNT)) {
+        block = average->block_count++;
+        average->block_sums[block][0] = 0;
+        average->block_sums[block][1] = 0;
+        average->block_fills[block] = 0;
+    }
+
+    average->block_sums[block][0] += real;
+    average->block_sums[block][1] += imaginary;
+    average->block_fills[block]++;
+}
+
+void sort_values(double* values, uint count) {
+    // Insertion sort, as there are only a few blocks
+    for (int i = 1; i < count; i++) {
+        double value = values[i];
+
+        int j = i - 1;
+        for (; j >= 0 && values[j] > value; j--) {
+            values[j + 1] = values[j];
+        }
+        values[j + 1] = value;
+    }
+}
+
+double get_median(double* sorted_values, uint count) {
+    if (count % 2 == 1) return sorted_values[count / 2];
+
+    return (sorted_values[count / 2 - 1] + sorted_values[count / 2]) / 2;
+}
+
+double complex get_robust_average(robust_average_t* average) {
+    uint count = average->block_count;
+    if (count == 0) return 0;
+
+    double complex means[AVERAGE_BLOCK_COUNT];
+    double sorted_reals[AVERAGE_BLOCK_COUNT], sorted_imaginaries[AVERAGE_BLOCK_COUNT];
+    for (int i = 0; i < count; i++) {
+        means[i] = ((double) average->block_sums[i][0] + (double) average->block_sums[i][1] * I) / average->block_fills[i];
+        sorted_reals[i] = creal(means[i]);
+        sorted_imaginaries[i] = cimag(means[i]);
+    }
+    sort_values(sorted_reals, count);
+    sort_values(sorted_imaginaries, count);
+    double complex median = get_median(sorted_reals, count) + get_median(sorted_imaginaries, count) * I;
+
+    // Distance of every block from the median, scaled to a full block as a partial last block is noisier. Its
+    // median is a spread that a few outliers can't inflate like a standard deviation
+    double distances[AVERAGE_BLOCK_COUNT], sorted_distances[AVERAGE_BLOCK_COUNT];
+    uint closest_block = 0;
+    for (int i = 0; i < count; i++) {
+        distances[i] = cabs(means[i] - median) * sqrt((double) average->block_fills[i] / average->block_size);
+        sorted_distances[i] = distances[i];
+        if (distances[i] < distances[closest_block]) closest_block = i;
+    }
+    sort_values(sorted_distances, count);
+    double outlier_threshold = AVERAGE_OUTLIER_THRESHOLD * get_median(sorted_distances, count);
+
+    // The means weigh every capture the same, whatever block it's in
+    double complex sum = 0, inlier_sum = 0;
+    uint value_count = 0, inlier_count = 0, outlier_count = 0;
+    for (int i = 0; i < count; i++) {
+        double complex block_sum = (double) average->block_sums[i][0] + (double) average->block_sums[i][1] * I;
+        sum += block_sum;
+        value_count += average->block_fills[i];
+
+        if (distances[i] > outlier_threshold) {
+            outlier_count++;
+            continue;
+        }
+        inlier_sum += block_sum;
+        inlier_count += average->block_fills[i];
+    }
+
+    outlier_block_count += outlier_count;
+    total_block_count += count;
+
+    average_t mode = get_measurement_profile()->average;
+    if (mode == AVERAGE_MEAN) return sum / value_count;
+    if (mode == AVERAGE_MEDIAN_OF_MEANS) return means[closest_block];
+
+    return inlier_sum / inlier_count;
+}
+
+void print_outlier_statistics() {
+    printf("Outliers: %u of %u blocks\n", outlier_block_count, total_block_count);
+}
+
+double complex* get_four_point_voltages(int input_iterations) {
+    // With coherent sampling the interval between one input sample and another is an exact number of samples
+    uint sample_index_spacing = sampling_plan.decimated_samples_per_period / INPUT_SAMPLE_SIZE;
+
+    // Allocate the memory for the voltage of every DUT, and for their averages
+    double complex* voltages = calloc(DUT_COUNT, sizeof(double complex));
+    robust_average_t* averages = calloc(DUT_COUNT, sizeof(robust_average_t));
+    if (voltages == NULL || averages == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR INPUT SAMPLES BUFFER!\n");
+
+        free(voltages);
+        free(averages);
+        return NULL;
+    }
+
+    for (int d = 0; d < DUT_COUNT; d++) {
+        init_robust_average(&averages[d], input_iterations);
+    }
+
+    // Instead of getting the samples in one period, average between multiple ones to remove noise
+    for (int i = 0; i < input_iterations; i++) {
+        // A host connecting drops the measurement, instead of waiting for all of its captures
+        if (measurement_interrupted()) {
+            free(voltages);
+            free(averages);
+            return NULL;
+        }
+
+        capture_samples(i, input_iterations);
+
+        // If the crossing position is UINT_MAX, we couldn't find the zero crossing
+        uint crossing = get_reference_crossing();
+        if (crossing == -1) {
+            printf("ERROR WHILE SEARCHING FOR ZERO CROSSING ON REFERENCE!\n");
+            continue;
+        }
+
+        // Use modular arithmetic to acquire the samples of every captured period without overflow,
+        // since the buffer holds whole periods the wraparound keeps the phase exact
+        // The input average isn't removed, as it cancels out in the differences between opposite samples, only
+        // the middle of the range is taken out to keep the sums small
+        int iteration_samples[DUT_COUNT * INPUT_SAMPLE_SIZE] = { 0 };
+        uint position = crossing;
+        for (int j = 0; j < INPUT_SAMPLE_SIZE * CAPTURE_PERIODS; j++) {
+            // The crossing falls between two samples, so interpolate the inputs at the same fraction
+            uint sample = position >> CROSSING_FRACTION_BITS;
+            uint next_sample = (sample + 1) % sample_channel_length;
+            int fraction = position & ((1 << CROSSING_FRACTION_BITS) - 1);
+
+            // The DUT inputs follow the reference in the round robin, so their sample with the same index
+            // was taken right after the reference one
+            for (int d = 0; d < DUT_COUNT; d++) {
+                uint16_t* dut_samples = get_sample_channel(1 + d);
+                int value = (dut_samples[sample] << CROSSING_FRACTION_BITS)
+                    + fraction * (dut_samples[next_sample] - dut_samples[sample]);
+
+                iteration_samples[d * INPUT_SAMPLE_SIZE + j % INPUT_SAMPLE_SIZE] +=
+                    ((value + (1 << (CROSSING_FRACTION_BITS - 1))) >> CROSSING_FRACTION_BITS) - SAMPLE_MIDSCALE;
+            }
+
+            position = (position + (sample_index_spacing << CROSSING_FRACTION_BITS)) % (sample_channel_length << CROSSING_FRACTION_BITS);
+        }
+
+        // The samples a quarter period after the crossing and the one opposite give the inphase part, the ones
+        // at and half a period after it the quadrature part
+        for (int d = 0; d < DUT_COUNT; d++) {
+            int* samples = iteration_samples + d * INPUT_SAMPLE_SIZE;
+            add_robust_average(&averages[d], samples[1] - samples[3], samples[0] - samples[2]);
+        }
+
+        accumulate_temperature();
+    }
+
+    if (!quiet_output) printf("\n");
+
+    // Back to 12-bit ADC units for one period, compensating the attenuation of the CIC filter at the fundamental
+    double scale = 1.0 / (CAPTURE_PERIODS * (1 << SAMPLE_FRACTION_BITS) * get_cic_gain(1));
+    for (int d = 0; d < DUT_COUNT; d++) {
+        voltages[d] = get_robust_average(&averages[d]) * scale;
+    }
+
+    free(averages);
+
+    return voltages;
+}
+
+void print_four_point_voltage(double complex voltage) {
+    const float conversion_factor = 3.3f / (1 << 12);
+
+    printf("Fundamental: %lf V %.2lf deg\n", cabs(voltage) * conversion_factor, carg(voltage) * 180 / M_PI);
+}
+
+uint get_harmonic_order(uint harmonic) {
+    // Only the odd harmonics are present in the (50% duty cycle) square wave
+    return 2 * harmonic + 1;
+}
+
+uint get_window_cycles(uint index) {
+    // Periods of a demodulated frequency in each capture. The harmonics of the first tone come first, then the
+    // ones of the second tone
+    uint tone_cycles = index < HARMONIC_COUNT ? CAPTURE_PERIODS : CAPTURE_PERIODS * SECOND_TONE_NUMERATOR / SECOND_TONE_DENOMINATOR;
+
+    return tone_cycles * get_harmonic_order(index % HARMONIC_COUNT);
+}
+
+double get_relative_frequency(uint index) {
+    // Demodulated frequency as a multiple of the first tone
+    return (double) get_window_cycles(index) / CAPTURE_PERIODS;
+}
+
+void free_harmonic_demodulator() {
+    free(harmonic_tables);
+    if (demodulation_scratch != scratch_demodulation_buffer) free(demodulation_scratch);
+    free(interpolator_sine_table);
+    free(crossing_rotation_table);
+
+    harmonic_tables = NULL;
+    demodulation_scratch = NULL;
+    interpolator_sine_table = NULL;
+    crossing_rotation_table = NULL;
+}
+
+bool init_harmonic_demodulator() {
+    uint samples_per_period = sampling_plan.decimated_samples_per_period;
+    uint window_length = samples_per_period * CAPTURE_PERIODS;
+
+    // The highest harmonic needs more than two samples per period, and no two demodulated frequencies may be the
+    // same or they couldn't be told apart
+    for (int i = 0; i < DEMODULATED_COUNT; i++) {
+        if (2 * get_window_cycles(i) >= window_length) {
+            printf("ERROR: TOO FEW SAMPLES PER PERIOD FOR %d HARMONICS!\n", HARMONIC_COUNT);
+
+            return false;
+        }
+
+        for (int j = 0; j < i; j++) {
+            if (get_window_cycles(i) == get_window_cycles(j)) {
+                printf("ERROR: THE HARMONICS OF BOTH TONES OVERLAP!\n");
+
+                return false;
+            }
+        }
+    }
+
+    // Release the tables of the previous sampling plan, if any
+    free_harmonic_demodulator();
+
+    // The sine and cosine of every demodulated frequency over a whole capture, indexed by sample position after
+    // the zero crossing, so that the correlation is a plain dot product over contiguous memory
+    harmonic_tables = calloc(DEMODULATED_COUNT * 2 * window_length, sizeof(int16_t));
+
+    // The scratch buffer is read on every correlation, so keep it out of the main SRAM banks when it fits
+    if (samples_per_period * CAPTURE_PERIODS <= SCRATCH_DEMODULATION_SAMPLES) {
+        demodulation_scratch = scratch_demodulation_buffer;
+    } else {
+        demodulation_scratch = calloc(samples_per_period * CAPTURE_PERIODS, sizeof(int16_t));
+    }
+
+    if (harmonic_tables == NULL || demodulation_scratch == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR HARMONIC TABLES!\n");
+
+        return false;
+    }
+
+    interpolator_sine_table = calloc(1 << INTERPOLATOR_TABLE_BITS, sizeof(int16_t));
+    if (interpolator_sine_table == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR INTERPOLATOR SINE TABLE!\n");
+
+        return false;
+    }
+
+    for (int i = 0; i < (1 << INTERPOLATOR_TABLE_BITS); i++) {
+        double phase = 2 * M_PI * i / (1 << INTERPOLATOR_TABLE_BITS);
+        interpolator_sine_table[i] = round(sin(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+    }
+
+    crossing_rotation_table = calloc(DEMODULATED_COUNT * 2 << CROSSING_FRACTION_BITS, sizeof(int16_t));
+    if (crossing_rotation_table == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR CROSSING ROTATION TABLE!\n");
+
+        return false;
+    }
+
+    // A fraction of a sample is that fraction of a window sample period of each frequency
+    for (int h = 0; h < DEMODULATED_COUNT; h++) {
+        for (int f = 0; f < (1 << CROSSING_FRACTION_BITS); f++) {
+            int16_t* rotation = (int16_t*) get_crossing_rotation(h, f);
+            double phase = 2 * M_PI * get_window_cycles(h) * f / ((double) window_length * (1 << CROSSING_FRACTION_BITS));
+            rotation[0] = round(cos(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+            rotation[1] = round(sin(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+        }
+    }
+
+    for (int h = 0; h < DEMODULATED_COUNT; h++) {
+        int16_t* sine_table = get_harmonic_table(h, false);
+        int16_t* cosine_table = get_harmonic_table(h, true);
+
+        for (int i = 0; i < window_length; i++) {
+            double phase = 2 * M_PI * get_window_cycles(h) * i / window_length;
+            sine_table[i] = round(sin(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+            cosine_table[i] = round(cos(phase) * (1 << SINE_TABLE_FRACTION_BITS));
+        }
+    }
+
+    return true;
+}
+
+void __not_in_flash_func(init_phase_interpolator)(interp_hw_t* interp, uint32_t phase, uint32_t phase_step) {
+    // Lane 0 holds the phase as a fraction of a turn in 32 bits, so it wraps around on its own. It adds the
+    // step raw on every pop, while the full result takes the top INTERPOLATOR_TABLE_BITS bits of the phase
+    // as a byte offset (index * 2) into the table. Lane 1 is left at 0 so it adds nothing to the full result
+    interp_config cfg = interp_default_config();
+    interp_config_set_add_raw(&cfg, true);
+    interp_config_set_shift(&cfg, 31 - INTERPOLATOR_TABLE_BITS);
+    interp_config_set_mask(&cfg, 1, INTERPOLATOR_TABLE_BITS);
+    interp_set_config(interp, 0, &cfg);
+
+    interp_config lane1_cfg = interp_default_config();
+    interp_set_config(interp, 1, &lane1_cfg);
+
+    interp_set_accumulator(interp, 0, phase);
+    interp_set_accumulator(interp, 1, 0);
+    interp_set_base(interp, 0, phase_step);
+    interp_set_base(interp, 1, 0);
+    interp_set_base(interp, 2, (uintptr_t) interpolator_sine_table);
+}
+
+void __not_in_flash_func(correlate_interpolated)(const int16_t* values, uint count, uint cycles,
+    int64_t* sine_accumulator, int64_t* cosine_accumulator) {
+    // The phase advances the given number of turns over all the values, rounded to the nearest 2^-32 of a turn.
+    // Starting half a table entry ahead rounds the table index to the nearest entry instead of truncating it
+    uint32_t phase_step = (((uint64_t) cycles << 32) + count / 2) / count;
+    uint32_t rounding = 1u << (31 - INTERPOLATOR_TABLE_BITS);
+
+    // interp0 gives the sine and interp1 the cosine, a quarter turn ahead
+    init_phase_interpolator(interp0, rounding, phase_step);
+    init_phase_interpolator(interp1, (1u << 30) + rounding, phase_step);
+
+    int64_t sine_sum = 0;
+    int64_t cosine_sum = 0;
+    for (int i = 0; i < count; i++) {
+        int value = values[i];
+
+        sine_sum += value * *(const int16_t*) (uintptr_t) interp_pop_full_result(interp0);
+        cosine_sum += value * *(const int16_t*) (uintptr_t) interp_pop_full_result(interp1);
+    }
+
+    *sine_accumulator += sine_sum;
+    *cosine_accumulator += cosine_sum;
+}
+
+void __not_in_flash_func(demodulate_harmonics)(harmonic_kernel_t kernel, uint zero_index,
+    int64_t sine_accumulators[][DEMODULATED_COUNT], int64_t cosine_accumulators[][DEMODULATED_COUNT]) {
+
+    for (int d = 0; d < DUT_COUNT; d++) {
+        uint16_t* input_samples = get_sample_channel(1 + d);
+
+        // Copy the DUT samples starting at the zero crossing, wrapping around the buffer, so that position j is
+        // j samples after the crossing. Only the middle of the range is removed, as the sine and cosine of whole
+        // periods add up to zero and leave the input average out of the correlation anyway
+        uint tail_length = sample_channel_length - zero_index;
+        for (int j = 0; j < tail_length; j++) {
+            demodulation_scratch[j] = input_samples[zero_index + j] - SAMPLE_MIDSCALE;
+        }
+        for (int j = tail_length; j < sample_channel_length; j++) {
+            demodulation_scratch[j] = input_samples[j - tail_length] - SAMPLE_MIDSCALE;
+        }
+
+        for (int h = 0; h < DEMODULATED_COUNT; h++) {
+            if (kernel == KERNEL_INTERPOLATOR) {
+                correlate_interpolated(demodulation_scratch, sample_channel_length, get_window_cycles(h),
+                    &sine_accumulators[d][h], &cosine_accumulators[d][h]);
+                continue;
+            }
+
+            sine_accumulators[d][h] += correlate(demodulation_scratch, get_harmonic_table(h, false), sample_channel_length);
+            cosine_accumulators[d][h] += correlate(demodulation_scratch, get_harmonic_table(h, true), sample_channel_length);
+        }
+    }
+}
+
+double complex* get_harmonic_voltages(int input_iterations) {
+    uint samples_per_period = sampling_plan.decimated_samples_per_period;
+
+    // Voltages of every harmonic of the first DUT, followed by the ones of the next DUT
+    double complex* voltages = calloc(DUT_COUNT * DEMODULATED_COUNT, sizeof(double complex));
+
+    // Average correlation of each input with the sine and cosine of each harmonic (the real and imaginary parts),
+    // relative to the zero crossing, in the same order as the voltages
+    robust_average_t* averages = calloc(DUT_COUNT * DEMODULATED_COUNT, sizeof(robust_average_t));
+
+    if (voltages == NULL || averages == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR HARMONIC VOLTAGES!\n");
+
+        free(voltages);
+        free(averages);
+        return NULL;
+    }
+
+    for (int i = 0; i < DUT_COUNT * DEMODULATED_COUNT; i++) {
+        init_robust_average(&averages[i], input_iterations);
+    }
+
+    for (int i = 0; i < input_iterations; i++) {
+        // A host connecting drops the measurement, instead of waiting for all of its captures
+        if (measurement_interrupted()) {
+            free(voltages);
+            free(averages);
+            return NULL;
+        }
+
+        capture_samples(i, input_iterations);
+
+        uint crossing = get_reference_crossing();
+        if (crossing == -1) {
+            printf("ERROR WHILE SEARCHING FOR ZERO CROSSING ON REFERENCE!\n");
+            continue;
+        }
+
+        int64_t sine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+        int64_t cosine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+        demodulate_harmonics(HARMONIC_KERNEL, crossing >> CROSSING_FRACTION_BITS, sine_accumulators, cosine_accumulators);
+        accumulate_temperature();
+
+        // The correlation starts at the sample before the crossing, so advance each frequency by the phase
+        // of the remaining fraction of a sample to refer it to the crossing itself. The rotation comes from a
+        // table in the same fixed point as the harmonic tables, so it stays in integers
+        uint fraction = crossing & ((1 << CROSSING_FRACTION_BITS) - 1);
+        for (int h = 0; h < DEMODULATED_COUNT; h++) {
+            const int16_t* rotation = get_crossing_rotation(h, fraction);
+            const int64_t rounding = 1 << (SINE_TABLE_FRACTION_BITS - 1);
+
+            for (int d = 0; d < DUT_COUNT; d++) {
+                int64_t inphase = sine_accumulators[d][h] * rotation[0] - cosine_accumulators[d][h] * rotation[1];
+                int64_t quadrature = sine_accumulators[d][h] * rotation[1] + cosine_accumulators[d][h] * rotation[0];
+
+                add_robust_average(&averages[d * DEMODULATED_COUNT + h], (inphase + rounding) >> SINE_TABLE_FRACTION_BITS,
+                    (quadrature + rounding) >> SINE_TABLE_FRACTION_BITS);
+            }
+        }
+    }
+
+    if (!quiet_output) printf("\n");
+
+    // Scale the correlations to match the 4-point voltage (which is twice the amplitude) in 12-bit ADC units, and
+    // multiply each harmonic by its order so all of them are relative to the same excitation amplitude
+    double scale = 4.0 / ((double) samples_per_period * CAPTURE_PERIODS
+        * (1 << SINE_TABLE_FRACTION_BITS) * (1 << SAMPLE_FRACTION_BITS));
+    for (int d = 0; d < DUT_COUNT; d++) {
+        for (int h = 0; h < DEMODULATED_COUNT; h++) {
+            // Also compensate the attenuation of the CIC filter at each frequency
+            uint harmonic_order = get_harmonic_order(h % HARMONIC_COUNT);
+            double harmonic_scale = scale * harmonic_order / get_cic_gain(get_relative_frequency(h));
+
+            uint index = d * DEMODULATED_COUNT + h;
+            voltages[index] = get_robust_average(&averages[index]) * harmonic_scale;
+        }
+    }
+
+    free(averages);
+
+    return voltages;
+}
+
+void print_harmonic_voltages(double complex* voltages) {
+    const float conversion_factor = 3.3f / (1 << 12);
+
+    for (int t = 0; t < TONE_COUNT; t++) {
+        if (TONE_COUNT > 1) printf("Tone %d harmonics:", t + 1);
+        else printf("Harmonics:");
+
+        for (int h = 0; h < HARMONIC_COUNT; h++) {
+            double complex voltage = voltages[t * HARMONIC_COUNT + h];
+            printf(" [%u] %lf V %.2lf deg", get_harmonic_order(h), cabs(voltage) * conversion_factor, carg(voltage) * 180 / M_PI);
+        }
+        printf("\n");
+    }
+}
+
+uint get_voltage_count() {
+    return get_demodulator() == DEMODULATOR_HARMONIC ? DEMODULATED_COUNT : 1;
+}
+
+double get_voltage_frequency(uint index) {
+    return get_reference_frequency() * (get_demodulator() == DEMODULATOR_HARMONIC ? get_relative_frequency(index) : 1);
+}
+
+void print_dut_label(uint dut_position) {
+    if (DUT_POSITION_COUNT == 1) return;
+
+    // DUT positions are numbered by multiplexer channel first, then by ADC input
+    uint mux_channel = dut_position / DUT_COUNT;
+    uint input_pin = INPUT_ADC_PIN + dut_position % DUT_COUNT;
+    if (MUX_CHANNEL_COUNT > 1) {
+        printf("DUT %u (GPIO %u, mux %u): ", dut_position, input_pin, mux_channel);
+    } else {
+        printf("DUT %u (GPIO %u): ", dut_position, input_pin);
+    }
+}
+
+double complex* measure_voltages(int input_iterations) {
+    uint voltage_count = get_voltage_count();
+
+    // Voltages of every DUT position, each with voltage_count values
+    double complex* voltages = calloc(DUT_POSITION_COUNT * voltage_count, sizeof(double complex));
+    if (voltages == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR VOLTAGES!\n");
+
+        return NULL;
+    }
+
+    // The temperature is averaged over every capture of the measurement
+    reset_temperature();
+    reset_phase_tracker_statistics();
+    reset_outlier_statistics();
+
+    // Every capture measures all the DUT inputs at once, so only the multiplexer channels need separate captures
+    for (int m = 0; m < MUX_CHANNEL_COUNT; m++) {
+        select_mux_channel(m);
+
+        double complex* mux_voltages = voltages + m * DUT_COUNT * voltage_count;
+
+        if (get_demodulator() == DEMODULATOR_HARMONIC) {
+            double complex* harmonic_voltages = get_harmonic_voltages(input_iterations);
+            if (harmonic_voltages == NULL) {
+                free(voltages);
+
+                return NULL;
+            }
+
+            for (int d = 0; d < DUT_COUNT && !quiet_output; d++) {
+                print_dut_label(m * DUT_COUNT + d);
+                print_harmonic_voltages(harmonic_voltages + d * DEMODULATED_COUNT);
+            }
+
+            for (int i = 0; i < DUT_COUNT * DEMODULATED_COUNT; i++) {
+                mux_voltages[i] = harmonic_voltages[i];
+            }
+
+            free(harmonic_voltages);
+        } else {
+            double complex* four_point_voltages = get_four_point_voltages(input_iterations);
+            if (four_point_voltages == NULL) {
+                free(voltages);
+
+                return NULL;
+            }
+
+            for (int d = 0; d < DUT_COUNT; d++) {
+                if (!quiet_output) {
+                    print_dut_label(m * DUT_COUNT + d);
+                    print_four_point_voltage(four_point_voltages[d]);
+                }
+
+                mux_voltages[d] = four_point_voltages[d];
+            }
+
+            free(four_point_voltages);
+        }
+    }
+
+    if (!quiet_output) {
+        if (PHASE_TRACKING) print_phase_tracker();
+        print_outlier_statistics();
+    }
+
+    return voltages;
+}
+
+double complex calculate_result(double complex dut_open_voltage, double complex dut_voltage, double temperature_delta) {
+    double complex dut_short_voltage = 0 + 0 * I; // Considering a perfect short
+
+    // Move the calibration constants to the current temperature (a delta of 0 leaves them unchanged)
+    double ri = get_compensated_ri(temperature_delta);
+    dut_open_voltage = get_compensated_open_voltage(dut_open_voltage, temperature_delta);
+
+    double complex result = (ri * RS * (dut_voltage - dut_short_voltage)) / (ri + RS * (dut_open_voltage - dut_voltage));
+
+    return result;
+}
+
+double get_component_value(double complex result, char component, double frequency_hz) {
+    // Capacitance in nF from the reactance, or resistance from the real part
+    if (component == 'C' || component == 'c') return -1 * 1000000000 / (2 * M_PI * frequency_hz * cimag(result));
+
+    return creal(result);
+}
+
+void print_result(double complex result, char component, double frequency_hz) {
+    double value = get_component_value(result, component, frequency_hz);
+
+    printf("[%9.2lf Hz] ", frequency_hz);
+    if (component == 'C' || component == 'c') {
+        printf("Capacitor value: %f nF\n", (float) value);
+    } else {
+        printf("Resistor value: %lf\n", value);
+    }
+}
+
+typedef struct {
+    const char* name;
+    uint64_t total_cycles;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+} benchmark_t;
+
+void start_benchmark(benchmark_t* benchmark, const char* name) {
+    benchmark->name = name;
+    benchmark->total_cycles = 0;
+    benchmark->min_cycles = UINT32_MAX;
+    benchmark->max_cycles = 0;
+}
+
+void add_benchmark_cycles(benchmark_t* benchmark, uint32_t cycles) {
+    benchmark->total_cycles += cycles;
+    if (cycles < benchmark->min_cycles) benchmark->min_cycles = cycles;
+    if (cycles > benchmark->max_cycles) benchmark->max_cycles = cycles;
+}
+
+void add_benchmark_run(benchmark_t* benchmark, uint32_t start_count) {
+    add_benchmark_cycles(benchmark, (start_count - read_cycle_counter()) & 0x00FFFFFF);
+}
+
+void print_benchmark(benchmark_t* benchmark) {
+    double average_cycles = (double) benchmark->total_cycles / BENCHMARK_RUNS;
+    printf("  %-22s %10.2lf us %10.0lf cycles (min %u, max %u, jitter %u)\n", benchmark->name,
+        average_cycles / (CLOCK_FREQ_HZ / 1000000), average_cycles, (uint) benchmark->min_cycles,
+        (uint) benchmark->max_cycles, (uint) (benchmark->max_cycles - benchmark->min_cycles));
+}
+
+void run_benchmark() {
+    printf("\nBenchmark on %s with %s kernels, running from %s, %d runs:\n", PLATFORM_NAME,
+        DSP_KERNELS ? "DSP" : "generic", PICO_COPY_TO_RAM ? "RAM" : "flash", BENCHMARK_RUNS);
+
+    benchmark_t benchmark;
+
+    // Every step after the capture works on the same (real) captured data, so both chips run the same workload
+    benchmark_t latency;
+    start_benchmark(&latency, "Capture to processing");
+    start_benchmark(&benchmark, "ADC capture");
+    for (int i = 0; i < BENCHMARK_RUNS; i++) {
+        uint32_t start = read_cycle_counter();
+        start_adc_sampling();
+        wait_for_adc_sampling();
+        add_benchmark_run(&benchmark, start);
+        add_benchmark_cycles(&latency, capture_latency_cycles);
+    }
+    print_benchmark(&benchmark);
+    print_benchmark(&latency);
+
+    if (CIC_DECIMATION > 1) {
+        start_benchmark(&benchmark, "CIC decimation");
+        for (int i = 0; i < BENCHMARK_RUNS; i++) {
+            uint32_t start = read_cycle_counter();
+            decimate_capture();
+            add_benchmark_run(&benchmark, start);
+        }
+        print_benchmark(&benchmark);
+    }
+
+    // The averages come from the DMA sniffer, so there's no averaging pass to time
+    uint16_t average_ref = get_reference_average();
+
+    uint crossing = 0;
+    start_benchmark(&benchmark, "Zero crossing search");
+    for (int i = 0; i < BENCHMARK_RUNS; i++) {
+        uint32_t start = read_cycle_counter();
+        crossing = find_zero_crossing(average_ref);
+        add_benchmark_run(&benchmark, start);
+    }
+    print_benchmark(&benchmark);
+
+    if (PHASE_TRACKING) {
+        start_benchmark(&benchmark, "Reference phase tracking");
+        for (int i = 0; i < BENCHMARK_RUNS; i++) {
+            uint32_t start = read_cycle_counter();
+            crossing = track_reference_phase();
+            add_benchmark_run(&benchmark, start);
+        }
+        print_benchmark(&benchmark);
+    }
+
+    if (crossing == -1) {
+        printf("ERROR WHILE SEARCHING FOR ZERO CROSSING ON REFERENCE!\n");
+        return;
+    }
+    uint zero_index = crossing >> CROSSING_FRACTION_BITS;
+
+    if (harmonic_tables != NULL) {
+        int64_t sine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+        int64_t cosine_accumulators[DUT_COUNT][DEMODULATED_COUNT] = { 0 };
+
+        start_benchmark(&benchmark, DSP_KERNELS ? "Harmonics (SMLALD)" : "Harmonics (tables)");
+        for (int i = 0; i < BENCHMARK_RUNS; i++) {
+            uint32_t start = read_cycle_counter();
+            demodulate_harmonics(KERNEL_TABLE, zero_index, sine_accumulators, cosine_accumulators);
+            add_benchmark_run(&benchmark, start);
+        }
+        print_benchmark(&benchmark);
+
+        start_benchmark(&benchmark, "Harmonics (interp)");
+        for (int i = 0; i < BENCHMARK_RUNS; i++) {
+            uint32_t start = read_cycle_counter();
+            demodulate_harmonics(KERNEL_INTERPOLATOR, zero_index, sine_accumulators, cosine_accumulators);
+            add_benchmark_run(&benchmark, start);
+        }
+        print_benchmark(&benchmark);
+    }
+}
+
+bool init_sampling(double frequency_hz) {
+    // Find the clock dividers that make the captures coherent with the excitation
+    if (!plan_coherent_sampling(frequency_hz, &sampling_plan)) return false;
+
+    init_pwm();
+
+    if (!init_capture_buffers()) return false;
+    // A profile with the 4-point demodulator has no use for the tables (and the benchmark skips them)
+    if (get_demodulator() == DEMODULATOR_HARMONIC) {
+        if (!init_harmonic_demodulator()) return false;
+    } else {
+        free_harmonic_demodulator();
+    }
+    if (PHASE_TRACKING && !init_phase_tracker()) return false;
+
+    return true;
+}
+
+bool track_external_reference() {
+    double frequency_hz = measure_reference_frequency();
+    if (frequency_hz == 0) return false;
+
+    printf("External reference: %.4lf Hz\n", frequency_hz);
+
+    // Small differences are followed by the phase tracker, so only plan the sampling again when it's too far off
+    if (fabs(frequency_hz - get_reference_frequency()) <= EXTERNAL_REFERENCE_TOLERANCE * frequency_hz) return true;
+
+    if (!init_sampling(frequency_hz)) return false;
+    print_sampling_plan();
+
+    return true;
+}
+
+bool init_profile_sampling() {
+    // An external reference sets the frequency by itself
+    if (EXTERNAL_REFERENCE) return true;
+
+    return init_sampling(get_measurement_profile()->frequency_hz);
+}
+
+// Estimates the time of a measurement with the profile, and its noise floor relative to the open circuit voltage of
+// the first DUT position. The DUTs must be open circuit, so the DUT input sees the whole excitation through the
+// reference resistor, and the noise floor includes the reference, the excitation and the ADC but no DUT
+bool characterize_profile(double* measurement_s, double* noise_floor_ppm) {
+    if (!init_profile_sampling()) return false;
+
+    const measurement_profile_t* profile = get_measurement_profile();
+    quiet_output = true;
+
+    // The first measurement also lets the phase tracker lock, and gives the time taken by every capture
+    uint64_t start_us = time_us_64();
+    double complex* voltages = measure_voltages(PROFILE_CHARACTERIZATION_RUNS);
+    uint64_t elapsed_us = time_us_64() - start_us;
+    if (voltages == NULL) {
+        quiet_output = false;
+        return false;
+    }
+    free(voltages);
+
+    // Spread of the open circuit fundamental of the first DUT position from one capture to the next
+    double complex sum = 0;
+    double square_sum = 0;
+    for (int r = 0; r < PROFILE_CHARACTERIZATION_RUNS; r++) {
+        voltages = measure_voltages(1);
+        if (voltages == NULL) {
+            quiet_output = false;
+            return false;
+        }
+
+        sum += voltages[0];
+        square_sum += creal(voltages[0]) * creal(voltages[0]) + cimag(voltages[0]) * cimag(voltages[0]);
+        free(voltages);
+    }
+    quiet_output = false;
+
+    double complex mean = sum / PROFILE_CHARACTERIZATION_RUNS;
+    double capture_deviation = sqrt(fmax(square_sum / PROFILE_CHARACTERIZATION_RUNS - cabs(mean) * cabs(mean), 0));
+
+    // The noise averages down with the square root of the captures (exactly so only for the plain mean), so drift
+    // slower than the captures isn't part of it
+    *measurement_s = elapsed_us / 1e6 / PROFILE_CHARACTERIZATION_RUNS * profile->iterations;
+    *noise_floor_ppm = capture_deviation / sqrt(profile->iterations) / cabs(mean) * 1e6;
+
+    return true;
+}
+
+bool characterize_profiles() {
+    uint selected_index = measurement_profile_index;
+
+    printf("\nCharacterizing the measurement profiles with every DUT open circuit, the noise floor is relative to the open circuit voltage of the first DUT position, from the spread of single captures...\n");
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        measurement_profile_index = p;
+
+        double measurement_s, noise_floor_ppm;
+        if (!characterize_profile(&measurement_s, &noise_floor_ppm)) {
+            measurement_profile_index = selected_index;
+            return false;
+        }
+
+        const measurement_profile_t* profile = get_measurement_profile();
+        printf("%c %d: %-8s %8.2lf s per measurement, noise floor %8.2lf ppm\n", p == selected_index ? '*' : ' ', p + 1,
+            profile->name, measurement_s, noise_floor_ppm);
+    }
+    measurement_profile_index = selected_index;
+
+    return init_profile_sampling();
+}
+
+bool fits_calibration(uint index, uint calibration_index) {
+    // The open circuit calibration only holds at the frequency and with the demodulator it was measured with
+    const measurement_profile_t* profile = &measurement_profiles[index];
+    const measurement_profile_t* calibration = &measurement_profiles[calibration_index];
+
+    return (EXTERNAL_REFERENCE || profile->frequency_hz == calibration->frequency_hz)
+        && get_profile_demodulator(profile) == get_profile_demodulator(calibration);
+}
+
+// Lets the operator (or the host, sending the number right after P) pick the profile. Once the open circuit
+// voltages are measured, only the profiles that fit them can be picked
+void select_measurement_profile(bool calibrated) {
+    printf("\n");
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        const measurement_profile_t* profile = &measurement_profiles[p];
+        printf("%c %d: %-8s %6u iterations at %8.2lf Hz, %s%s\n", p == measurement_profile_index ? '*' : ' ', p + 1,
+            profile->name, profile->iterations, profile->frequency_hz,
+            get_profile_demodulator(profile) == DEMODULATOR_HARMONIC ? "harmonic" : "4-point",
+            calibrated && !fits_calibration(p, measurement_profile_index) ? ", needs another calibration" : "");
+    }
+
+    printf("Input the number of the profile to use (or anything else to keep the current one)...\n");
+    uint previous_index = measurement_profile_index;
+    char command = getchar();
+    if (command >= '1' && command < '1' + PROFILE_COUNT) {
+        uint index = command - '1';
+        if (calibrated && !fits_calibration(index, previous_index)) {
+            printf("WARNING: THE %s PROFILE DOESN'T FIT THE OPEN CIRCUIT CALIBRATION, KEEPING THE CURRENT ONE!\n",
+                measurement_profiles[index].name);
+        } else {
+            measurement_profile_index = index;
+        }
+    }
+
+    // A profile whose frequency can't be sampled isn't kept
+    if (!init_profile_sampling()) {
+        printf("WARNING: KEEPING THE %s PROFILE!\n", measurement_profiles[previous_index].name);
+        measurement_profile_index = previous_index;
+        init_profile_sampling();
+    }
+    if (measurement_profile_index != previous_index) save_measurement_profile();
+
+    printf("Using the %s profile\n", get_measurement_profile()->name);
+    print_sampling_plan();
+}
+
+void init_binning() {
+    gpio_init(BIN_START_PIN);
+    gpio_set_dir(BIN_START_PIN, GPIO_IN);
+    gpio_pull_up(BIN_START_PIN);
+
+    uint output_mask = ((1u << BIN_OUTPUT_PIN_COUNT) - 1) << BIN_OUTPUT_BASE_PIN | 1u << BIN_END_OF_TEST_PIN;
+    gpio_init_mask(output_mask);
+    gpio_set_dir_out_masked(output_mask);
+    gpio_put_masked(output_mask, 0);
+}
+
+bool measure_part(int iterations, double complex* open_circuit_voltages, double calibration_temperature,
+    char component, double* value) {
+    double complex* dut_voltages = measure_voltages(iterations);
+    if (dut_voltages == NULL) return false;
+
+    // Parts are judged on the fundamental of the first DUT position
+    double temperature_delta = TEMPERATURE_SENSING ? get_temperature() - calibration_temperature : 0;
+    double complex result = calculate_result(open_circuit_voltages[0], dut_voltages[0], temperature_delta);
+    *value = get_component_value(result, component, get_voltage_frequency(0));
+
+    free(dut_voltages);
+
+    return true;
+}
+
+uint get_bin(double value) {
+    for (int b = 0; b < bin_count; b++) {
+        double tolerance = bin_limits[b].nominal * bin_limits[b].tolerance_percent / 100;
+        if (fabs(value - bin_limits[b].nominal) <= tolerance) return b + 1;
+    }
+
+    return 0;
+}
+
+int find_bin_profile(double complex* open_circuit_voltages, double calibration_temperature, char component) {
+    double tightest_tolerance = INFINITY;
+    for (int b = 0; b < bin_count; b++) {
+        double tolerance = bin_limits[b].nominal * bin_limits[b].tolerance_percent / 100;
+        if (tolerance < tightest_tolerance) tightest_tolerance = tolerance;
+    }
+
+    // Only the fastest profile that fits the calibration measures the part in place repeatedly, as the spread of
+    // the others follows from averaging down with the square root of their captures
+    uint calibration_index = measurement_profile_index;
+    int fastest_index = -1;
+    for (int p = PROFILE_COUNT - 1; p >= 0; p--) {
+        if (fits_calibration(p, calibration_index)) fastest_index = p;
+    }
+    if (fastest_index < 0) return -1;
+
+    measurement_profile_index = fastest_index;
+    double sum = 0, square_sum = 0;
+    uint64_t start_us = time_us_64();
+    for (int r = 0; r < BIN_PROFILE_RUNS; r++) {
+        double value;
+        if (!measure_part(measurement_profiles[fastest_index].iterations, open_circuit_voltages, calibration_temperature,
+            component, &value)) {
+            measurement_profile_index = calibration_index;
+            return -1;
+        }
+
+        sum += value;
+        square_sum += value * value;
+    }
+    measurement_profile_index = calibration_index;
+
+    double capture_ms = (time_us_64() - start_us) / 1000.0 / BIN_PROFILE_RUNS / measurement_profiles[fastest_index].iterations;
+    double mean = sum / BIN_PROFILE_RUNS;
+    double capture_deviation = sqrt(fmax(square_sum / BIN_PROFILE_RUNS - mean * mean, 0))
+        * sqrt(measurement_profiles[fastest_index].iterations);
+
+    int slowest_index = fastest_index;
+    for (int p = fastest_index; p < PROFILE_COUNT; p++) {
+        if (!fits_calibration(p, calibration_index)) continue;
+        slowest_index = p;
+
+        double part_ms = capture_ms * measurement_profiles[p].iterations;
+        double deviation = capture_deviation / sqrt(measurement_profiles[p].iterations);
+        printf("%-8s %6u iterations: %10.2lf ms per part, %8.2lf parts/s, deviation %lf%s\n", measurement_profiles[p].name,
+            measurement_profiles[p].iterations, part_ms, 1000 / part_ms, deviation, p == fastest_index ? "" : " (estimated)");
+
+        if (deviation <= BIN_RESOLUTION_FRACTION * tightest_tolerance) return p;
+    }
+
+    printf("WARNING: NO PROFILE MEETS THE BIN RESOLUTION, USING THE SLOWEST!\n");
+
+    return slowest_index;
+}
+
+// Reads a number typed at the console up to Enter, echoing it. Returns false for anything but a number
+bool read_console_number(double* value) {
+    char text[CONSOLE_NUMBER_LENGTH];
+    uint length = 0;
+    while (true) {
+        int character = getchar();
+        if (character == '\r' || character == '\n') break;
+
+        // Backspace and delete take back the last character
+        if ((character == '\b' || character == 127) && length > 0) {
+            length--;
+            printf("\b \b");
+        } else if (character >= ' ' && character < 127 && length < sizeof(text) - 1) {
+            text[length++] = character;
+            putchar(character);
+        }
+    }
+    text[length] = 0;
+    printf("\n");
+
+    char* end;
+    *value = strtod(text, &end);
+
+    return length > 0 && *end == 0;
+}
+
+void print_bin_limits() {
+    for (int b = 0; b < bin_count; b++) {
+        printf("Bin %d: %lf +- %.3lf%%\n", b + 1, bin_limits[b].nominal, bin_limits[b].tolerance_percent);
+    }
+}
+
+// Asks for the limits of every bin, in the order parts are tried against them, and keeps them in the flash
+void enter_bin_limits() {
+    bin_limit_t entered[BIN_MAX_COUNT];
+    uint entered_count = 0;
+    while (entered_count < BIN_MAX_COUNT) {
+        printf("Input the nominal value of bin %u (or just Enter when done)...\n", entered_count + 1);
+        double nominal, tolerance_percent;
+        if (!read_console_number(&nominal)) break;
+
+        printf("Input the tolerance of bin %u in %%...\n", entered_count + 1);
+        if (!read_console_number(&tolerance_percent) || nominal <= 0 || tolerance_percent <= 0) {
+            printf("WARNING: INVALID BIN LIMIT, INPUT IT AGAIN!\n");
+            continue;
+        }
+
+        entered[entered_count].nominal = nominal;
+        entered[entered_count].tolerance_percent = tolerance_percent;
+        entered_count++;
+    }
+
+    // The binning needs at least one bin, so nothing entered keeps the previous limits
+    if (entered_count == 0) {
+        printf("WARNING: NO BIN LIMITS ENTERED, KEEPING THE PREVIOUS ONES!\n");
+        return;
+    }
+
+    bin_count = entered_count;
+    memcpy(bin_limits, entered, entered_count * sizeof(bin_limit_t));
+    save_measurement_profile();
+}
+
+void run_binning(double complex* open_circuit_voltages, double calibration_temperature, char component) {
+    init_binning();
+
+    printf("\nBin limits:\n");
+    print_bin_limits();
+    printf("Place a part for choosing the measurement profile and press Enter (or E to enter new bin limits)...\n");
+    char command = getchar();
+    while (command == 'E' || command == 'e') {
+        enter_bin_limits();
+        print_bin_limits();
+        printf("Place a part for choosing the measurement profile and press Enter (or E to enter new bin limits)...\n");
+        command = getchar();
+    }
+
+    quiet_output = true;
+    int profile = find_bin_profile(open_circuit_voltages, calibration_temperature, component);
+    if (profile < 0) {
+        quiet_output = false;
+        return;
+    }
+
+    // The profile only changes the captures and how they're averaged, as it has the calibration's frequency
+    uint calibration_index = measurement_profile_index;
+    measurement_profile_index = profile;
+    int iterations = get_measurement_profile()->iterations;
+
+    printf("\nBinning with the %s profile, waiting for start of test (press Q to stop)...\n", get_measurement_profile()->name);
+
+    // The throughput is timed from the start of test to the end of test strobe of every part, leaving out the
+    // profile search and the time the handler takes to bring the next part
+    uint part_count = 0;
+    uint64_t report_test_us = 0;
+    while (true) {
+        // Wait for the handler to place a part, still checking the console
+        int command = PICO_ERROR_TIMEOUT;
+        while (gpio_get(BIN_START_PIN)) {
+            command = getchar_timeout_us(0);
+            if (command == 'Q' || command == 'q') break;
+        }
+        if (command == 'Q' || command == 'q') break;
+        uint64_t start_us = time_us_64();
+
+        double value;
+        if (!measure_part(iterations, open_circuit_voltages, calibration_temperature, component, &value)) break;
+        uint bin = get_bin(value);
+
+        // The bin must be on the outputs before the strobe, and stays until the next part
+        gpio_put_masked(((1u << BIN_OUTPUT_PIN_COUNT) - 1) << BIN_OUTPUT_BASE_PIN, bin << BIN_OUTPUT_BASE_PIN);
+        gpio_put(BIN_END_OF_TEST_PIN, 1);
+        sleep_us(BIN_STROBE_US);
+        gpio_put(BIN_END_OF_TEST_PIN, 0);
+        report_test_us += time_us_64() - start_us;
+
+        // Each part is only measured once, even if the handler holds the start line
+        while (!gpio_get(BIN_START_PIN)) tight_loop_contents();
+
+        part_count++;
+        if (part_count % BIN_REPORT_PARTS == 0) {
+            printf("%u parts, %.2lf parts/s, last %lf in bin %u\n", part_count, BIN_REPORT_PARTS / (report_test_us / 1e6), value, bin);
+            report_test_us = 0;
+        }
+    }
+
+    measurement_profile_index = calibration_index;
+    quiet_output = false;
+}
+
+void run_triggered(double complex* open_circuit_voltages, double calibration_temperature, char component) {
+    printf("\nWaiting for triggers on GPIO %d (press Q to stop)...\n", TRIGGER_PIN);
+
+    quiet_output = true;
+    while (true) {
+        // The first capture starts right at the trigger, so the multiplexer must already be on the first channel
+        select_mux_channel(0);
+        arm_trigger();
+
+        int command = PICO_ERROR_TIMEOUT;
+        while (!capture_triggered && command != 'Q' && command != 'q') command = getchar_timeout_us(0);
+
+        // Disarm, but a trigger that arrived meanwhile already started a capture that has to be measured
+        gpio_set_irq_enabled(TRIGGER_PIN, TRIGGER_EDGE, false);
+        if (!capture_triggered) break;
+
+        uint64_t edge_us = trigger_us;
+        uint64_t start_latency_us = capture_start_us - edge_us;
+
+        double value;
+        if (!measure_part(TRIGGER_ITERATIONS, open_circuit_voltages, calibration_temperature, component, &value)) break;
+        uint64_t measurement_us = time_us_64() - edge_us;
+
+        printf("Trigger at %.6lf s, capture started after %u us, done after %.2lf ms: %lf\n",
+            edge_us / 1e6, (uint) start_latency_us, measurement_us / 1000.0, value);
+    }
+    quiet_output = false;
+}
+
+// Set by the monitor timer on every period, unless the last measurement is still running, which is an overrun
+volatile bool monitor_measuring;
+volatile bool monitor_measurement_due;
+volatile uint monitor_tick_count;
+volatile uint monitor_overrun_count;
+
+bool monitor_timer_callback(repeating_timer_t* timer) {
+    (void) timer;
+
+    monitor_tick_count++;
+
+    if (monitor_measuring) monitor_overrun_count++;
+    else monitor_measurement_due = true;
+
+    return true;
+}
+
+typedef struct {
+    // Start of each measurement minus its scheduled time, in microseconds
+    uint count;
+    double square_sum;
+    int64_t max;
+} jitter_t;
+
+void print_jitter(jitter_t* jitter) {
+    printf("Schedule jitter: %.1lf us RMS, %lld us max, %u overruns in %u measurements\n",
+        sqrt(jitter->square_sum / jitter->count), (long long) jitter->max, monitor_overrun_count, jitter->count);
+}
+
+void run_monitor(double complex* open_circuit_voltages, double calibration_temperature, char component) {
+    monitor_measuring = false;
+    monitor_measurement_due = false;
+    monitor_tick_count = 0;
+    monitor_overrun_count = 0;
+
+    // Every measurement has to fit in the period, or each one would be an overrun, so time one with everything the
+    // loop does for it
+    printf("\nTiming a measurement with the %s profile...\n", get_measurement_profile()->name);
+    quiet_output = true;
+    uint64_t timing_start_us = time_us_64();
+    if (EXTERNAL_REFERENCE && !track_external_reference()) {
+        quiet_output = false;
+        return;
+    }
+    double complex* timing_voltages = measure_voltages(get_measurement_profile()->iterations);
+    if (timing_voltages == NULL) {
+        quiet_output = false;
+        return;
+    }
+    free(timing_voltages);
+    double measurement_us = (time_us_64() - timing_start_us) * MONITOR_TIMING_MARGIN;
+
+    int64_t period_us = MONITOR_PERIOD_US;
+    if (measurement_us > period_us) {
+        period_us = (int64_t) ceil(measurement_us / 1e6) * 1000000;
+        printf("WARNING: THE %s PROFILE TAKES UP TO %.1lf s, SO THE MONITOR PERIOD IS STRETCHED TO %.0lf s!\n",
+            get_measurement_profile()->name, measurement_us / 1e6, period_us / 1e6);
+    }
+
+    // A negative delay makes the period from the start of one callback to the next, so it doesn't drift
+    repeating_timer_t timer;
+    if (!add_repeating_timer_us(-period_us, monitor_timer_callback, NULL, &timer)) {
+        printf("ERROR WHILE STARTING THE MONITOR TIMER!\n");
+
+        quiet_output = false;
+        return;
+    }
+
+    // Every tone of every DUT position, the fundamentals only. Before the calibration there are only the voltages
+    uint tone_count = get_demodulator() == DEMODULATOR_HARMONIC ? TONE_COUNT : 1;
+    printf("Measuring every %.3lf s (press Q to stop)...\n", period_us / 1e6);
+    printf("Time (s), %s of every %sDUT position\n",
+        open_circuit_voltages != NULL ? "value" : "voltage (real, imaginary, in ADC units)", tone_count > 1 ? "tone of every " : "");
+
+    jitter_t jitter = { 0 };
+    uint64_t first_start_us = 0;
+    uint first_tick = 0;
+    while (true) {
+        int command = PICO_ERROR_TIMEOUT;
+        while (!monitor_measurement_due && command != 'Q' && command != 'q') command = getchar_timeout_us(0);
+        if (!monitor_measurement_due) break;
+
+        monitor_measuring = true;
+        monitor_measurement_due = false;
+        uint tick = monitor_tick_count;
+        uint64_t start_us = time_us_64();
+
+        // The schedule is relative to the first measurement, skipping the periods lost to overruns
+        if (jitter.count == 0) {
+            first_start_us = start_us;
+            first_tick = tick;
+        }
+        int64_t delay_us = start_us - (first_start_us + (uint64_t) (tick - first_tick) * period_us);
+        jitter.count++;
+        jitter.square_sum += (double) delay_us * delay_us;
+        if (llabs(delay_us) > jitter.max) jitter.max = llabs(delay_us);
+
+        if (EXTERNAL_REFERENCE && !track_external_reference()) break;
+
+        double complex* dut_voltages = measure_voltages(get_measurement_profile()->iterations);
+        if (dut_voltages == NULL) break;
+
+        double temperature_delta = TEMPERATURE_SENSING ? get_temperature() - calibration_temperature : 0;
+
+        // The fundamental of every tone of every DUT position, timestamped with the start of the measurement
+        uint voltage_count = get_voltage_count();
+        printf("%.6lf", (start_us - first_start_us) / 1e6);
+        for (int d = 0; d < DUT_POSITION_COUNT; d++) {
+            for (int t = 0; t < tone_count; t++) {
+                uint index = d * voltage_count + t * HARMONIC_COUNT;
+                if (open_circuit_voltages == NULL) {
+                    printf(", %lf, %lf", creal(dut_voltages[index]), cimag(dut_voltages[index]));
+                    continue;
+                }
+
+                double complex result = calculate_result(open_circuit_voltages[index], dut_voltages[index], temperature_delta);
+                printf(", %lf", get_component_value(result, component, get_voltage_frequency(t * HARMONIC_COUNT)));
+            }
+        }
+        printf("\n");
+
+        free(dut_voltages);
+
+        if (jitter.count % MONITOR_REPORT_MEASUREMENTS == 0) print_jitter(&jitter);
+
+        monitor_measuring = false;
+    }
+    quiet_output = false;
+
+    cancel_repeating_timer(&timer);
+    if (jitter.count > 0) print_jitter(&jitter);
+}
+
+void fill_stream_frame(uint8_t* frame, uint32_t type, uint32_t sequence, uint32_t dropped_count, uint payload_size) {
+    stream_frame_header_t* header = (stream_frame_header_t*) frame;
+    *header = (stream_frame_header_t) {
+        .magic = STREAM_FRAME_MAGIC,
+        .type = type,
+        .sequence = sequence,
+        .payload_size = payload_size,
+        .start_us = capture_start_us,
+        .frequency_hz = sampling_plan.frequency_hz,
+        .period_cycles = sampling_plan.period_cycles,
+        .adc_period_256ths = sampling_plan.adc_period_256ths,
+        .samples_per_period = sampling_plan.samples_per_period,
+        .channel_count = ADC_CHANNEL_COUNT,
+        .capture_periods = CAPTURE_PERIODS,
+        .channel_length = adc_channel_length,
+        .start_pwm_count = capture_start_pwm_count,
+        .pwm_wrap = sampling_plan.pwm_wrap,
+        .start_second_pwm_count = capture_start_second_pwm_count,
+        .second_pwm_wrap = sampling_plan.second_pwm_wrap,
+        .pwm_divider_16ths = sampling_plan.pwm_divider_16ths,
+        .second_pwm_divider_16ths = sampling_plan.second_pwm_divider_16ths,
+        .dropped_count = dropped_count,
+        .temperature_code = TEMPERATURE_SENSING ? capture_temperature_code : 0
+    };
+
+    uint8_t* payload = frame + sizeof(stream_frame_header_t);
+    if (type == STREAM_FRAME_CAPTURE) {
+        memcpy(payload, adc_capture_buffer, payload_size);
+    } else {
+        uint32_t* words = (uint32_t*) payload;
+        for (int i = 0; i < payload_size / sizeof(uint32_t); i++) {
+            words[i] = sequence * (payload_size / sizeof(uint32_t)) + i;
+        }
+    }
+}
+
+uint write_stream(const uint8_t* data, uint size) {
+    // TinyUSB isn't reentrant and the stdio driver runs its task from a user interrupt that the USB interrupt
+    // raises, so only those two are held off meanwhile. The DMA and trigger interrupts keep running
+    bool usb_enabled = irq_is_enabled(USBCTRL_IRQ);
+    bool user_enabled[NUM_USER_IRQS];
+    irq_set_enabled(USBCTRL_IRQ, false);
+    for (int i = 0; i < NUM_USER_IRQS; i++) {
+        user_enabled[i] = irq_is_enabled(FIRST_USER_IRQ + i);
+        irq_set_enabled(FIRST_USER_IRQ + i, false);
+    }
+
+    uint written = 0;
+    uint available = tud_vendor_write_available();
+    if (available > 0) {
+        written = tud_vendor_write(data, size < available ? size : available);
+        tud_vendor_write_flush();
+    }
+
+    for (int i = 0; i < NUM_USER_IRQS; i++) {
+        irq_set_enabled(FIRST_USER_IRQ + i, user_enabled[i]);
+    }
+    irq_set_enabled(USBCTRL_IRQ, usb_enabled);
+
+    return written;
+}
+
+void run_stream(uint32_t type) {
+    // Two frames, so one can be filled while the other goes out
+    uint payload_size = adc_capture_buffer_size * sizeof(uint16_t);
+    uint frame_size = sizeof(stream_frame_header_t) + payload_size;
+    uint8_t* frames[2] = { malloc(frame_size), malloc(frame_size) };
+    if (frames[0] == NULL || frames[1] == NULL) {
+        printf("ERROR WHILE ALLOCATING MEMORY FOR STREAM FRAMES!\n");
+
+        free(frames[0]);
+        return;
+    }
+
+    printf("\nStreaming %s frames of %u bytes on the data interface (press Q to stop)...\n",
+        type == STREAM_FRAME_CAPTURE ? "capture" : "test", frame_size);
+
+    bool frame_full[2] = { false, false };
+    uint fill_index = 0, send_index = 0, send_offset = 0;
+    uint32_t sequence = 0, dropped_count = 0;
+    bool capturing = false;
+
+    uint64_t start_us = time_us_64();
+    uint64_t report_us = start_us;
+    uint64_t sent_bytes = 0, report_sent_bytes = 0;
+    while (true) {
+        int command = getchar_timeout_us(0);
+        if (command == 'Q' || command == 'q') break;
+
+        // Frame a finished capture, or a test frame, whenever one of the frames is free
+        capture_event_t event;
+        bool frame_ready = type == STREAM_FRAME_TEST;
+        if (capturing && queue_try_remove(&capture_queue, &event)) {
+            adc_fifo_drain();
+            read_temperature_sensor();
+            capturing = false;
+            frame_ready = true;
+        }
+        if (frame_ready) {
+            if (!frame_full[fill_index]) {
+                fill_stream_frame(frames[fill_index], type, sequence, dropped_count, payload_size);
+                frame_full[fill_index] = true;
+                fill_index ^= 1;
+                sequence++;
+            } else if (type == STREAM_FRAME_CAPTURE) {
+                dropped_count++;
+                sequence++;
+            }
+        }
+
+        // The next capture runs while the frames go out
+        if (type == STREAM_FRAME_CAPTURE && !capturing) {
+            start_adc_sampling();
+            capturing = true;
+        }
+
+        if (frame_full[send_index]) {
+            uint written = write_stream(frames[send_index] + send_offset, frame_size - send_offset);
+            send_offset += written;
+            sent_bytes += written;
+            if (send_offset == frame_size) {
+                frame_full[send_index] = false;
+                send_index ^= 1;
+                send_offset = 0;
+            }
+        }
+
+        uint64_t now_us = time_us_64();
+        if (now_us - report_us >= STREAM_REPORT_US) {
+            double bytes_per_s = (sent_bytes - report_sent_bytes) * 1e6 / (now_us - report_us);
+            printf("Streaming %8.1lf kB/s (%5.1lf%% of the full speed limit), %u frames, %u dropped\n",
+                bytes_per_s / 1000, 100 * bytes_per_s / USB_FULL_SPEED_BULK_BYTES_PER_S, (uint) sequence, (uint) dropped_count);
+
+            report_us = now_us;
+            report_sent_bytes = sent_bytes;
+        }
+    }
+
+    if (capturing) wait_for_adc_sampling();
+
+    uint64_t finish_us = time_us_64();
+    while (send_offset != 0 && time_us_64() - finish_us < STREAM_FINISH_TIMEOUT_US) {
+        uint written = write_stream(frames[send_index] + send_offset, frame_size - send_offset);
+        send_offset = (send_offset + written) % frame_size;
+        sent_bytes += written;
+    }
+
+    double average_bytes_per_s = sent_bytes * 1e6 / (time_us_64() - start_us);
+    printf("Streamed %.1lf kB/s on average, %u frames, %u dropped\n", average_bytes_per_s / 1000, (uint) sequence,
+        (uint) dropped_count);
+
+    free(frames[0]);
+    free(frames[1]);
+}
+
+// End of the firmware image, provided by the linker script
+extern char __flash_binary_end;
+
+const log_sector_header_t* get_log_sector_header(uint sector) {
+    return (const log_sector_header_t*) (XIP_BASE + LOG_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE);
+}
+
+const log_record_t* get_log_page(uint sector, uint page) {
+    return (const log_record_t*) ((const uint8_t*) get_log_sector_header(sector) + page * FLASH_PAGE_SIZE);
+}
+
+bool is_log_sector(uint sector) {
+    const log_sector_header_t* header = get_log_sector_header(sector);
+
+    return header->magic == LOG_MAGIC && header->record_size == sizeof(log_record_t);
+}
+
+bool load_log() {
+    if ((uintptr_t) &__flash_binary_end - XIP_BASE > LOG_FLASH_OFFSET) {
+        printf("ERROR WHILE PLACING THE LOG, THE FIRMWARE OVERLAPS IT!\n");
+
+        return false;
+    }
+
+    // Continue from the newest sector, or start at the first one on the next spill if there's no log
+    bool found = false;
+    log_sector = LOG_FLASH_SECTORS - 1;
+    log_page = LOG_PAGES_PER_SECTOR;
+    log_sector_sequence = -1;
+    log_record_sequence = 0;
+    for (int s = 0; s < LOG_FLASH_SECTORS; s++) {
+        const log_sector_header_t* header = get_log_sector_header(s);
+        if (!is_log_sector(s)) continue;
+        if (found && (int32_t) (header->sector_sequence - log_sector_sequence) < 0) continue;
+
+        found = true;
+        log_sector = s;
+        log_sector_sequence = header->sector_sequence;
+        log_record_sequence = header->first_record_sequence;
+    }
+    if (!found) return true;
+
+    // Pages are only written whole, so the first erased one is where the sector continues
+    for (log_page = 1; log_page < LOG_PAGES_PER_SECTOR; log_page++) {
+        if (get_log_page(log_sector, log_page)->sequence == 0xFFFFFFFF) break;
+    }
+    log_record_sequence += (log_page - 1) * LOG_RECORDS_PER_PAGE;
+
+    return true;
+}
+
+void spill_log_page() {
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+
+    uint tail = (log_ring_head + LOG_RAM_RECORDS - log_ring_count) % LOG_RAM_RECORDS;
+    for (int i = 0; i < LOG_RECORDS_PER_PAGE; i++) {
+        memcpy(page + i * sizeof(log_record_t), &log_ring[(tail + i) % LOG_RAM_RECORDS], sizeof(log_record_t));
+    }
+
+    // The flash can't be read while it's being written, so nothing else may run from it in the meantime
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    // Moving on to the next sector erases it, so every sector wears the same as the log goes around
+    if (log_page == LOG_PAGES_PER_SECTOR) {
+        log_sector = (log_sector + 1) % LOG_FLASH_SECTORS;
+        log_sector_sequence++;
+
+        uint8_t header_page[FLASH_PAGE_SIZE];
+        memset(header_page, 0xFF, sizeof(header_page));
+        log_sector_header_t* header = (log_sector_header_t*) header_page;
+        header->magic = LOG_MAGIC;
+        header->sector_sequence = log_sector_sequence;
+        header->first_record_sequence = ((log_record_t*) page)->sequence;
+        header->record_size = sizeof(log_record_t);
+
+        uint32_t sector_offset = LOG_FLASH_OFFSET + log_sector * FLASH_SECTOR_SIZE;
+        flash_range_erase(sector_offset, FLASH_SECTOR_SIZE);
+        flash_range_program(sector_offset, header_page, FLASH_PAGE_SIZE);
+        log_page = 1;
+    }
+
+    flash_range_program(LOG_FLASH_OFFSET + log_sector * FLASH_SECTOR_SIZE + log_page * FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE);
+    restore_interrupts(interrupts);
+
+    log_page++;
+    log_ring_count -= LOG_RECORDS_PER_PAGE;
+}
+
+void add_log_record(double complex* voltages, double temperature) {
+    log_record_t* record = &log_ring[log_ring_head];
+    record->sequence = log_record_sequence++;
+    record->time_ms = to_ms_since_boot(get_absolute_time());
+    record->frequency_hz = get_reference_frequency();
+    record->temperature_c = temperature;
+
+    uint voltage_count = get_voltage_count();
+    for (int d = 0; d < DUT_POSITION_COUNT; d++) {
+        record->voltages[2 * d] = creal(voltages[d * voltage_count]);
+        record->voltages[2 * d + 1] = cimag(voltages[d * voltage_count]);
+    }
+
+    log_ring_head = (log_ring_head + 1) % LOG_RAM_RECORDS;
+    log_ring_count++;
+
+    if (log_ring_count >= LOG_RECORDS_PER_PAGE) spill_log_page();
+}
+
+void print_log_record(const log_record_t* record) {
+    printf("%u, %.3lf, %.4lf, %.2lf", (uint) record->sequence, record->time_ms / 1000.0, record->frequency_hz, record->temperature_c);
+    for (int i = 0; i < 2 * DUT_POSITION_COUNT; i++) {
+        printf(", %.6lf", record->voltages[i]);
+    }
+    printf("\n");
+}
+
+void dump_log() {
+    printf("\nSequence, time since boot (s), frequency (Hz), temperature (C), voltages (real, imaginary) of every DUT position\n");
+
+    // The oldest sector is the one after the newest, once the log has gone around
+    uint record_count = 0;
+    for (int i = 1; i <= LOG_FLASH_SECTORS; i++) {
+        uint sector = (log_sector + i) % LOG_FLASH_SECTORS;
+        if (!is_log_sector(sector)) continue;
+
+        for (int p = 1; p < LOG_PAGES_PER_SECTOR; p++) {
+            const log_record_t* records = get_log_page(sector, p);
+            if (records->sequence == 0xFFFFFFFF) break;
+
+            for (int r = 0; r < LOG_RECORDS_PER_PAGE; r++) {
+                print_log_record(&records[r]);
+            }
+            record_count += LOG_RECORDS_PER_PAGE;
+        }
+    }
+
+    // Followed by the newest records, still in RAM
+    uint tail = (log_ring_head + LOG_RAM_RECORDS - log_ring_count) % LOG_RAM_RECORDS;
+    for (int i = 0; i < log_ring_count; i++) {
+        print_log_record(&log_ring[(tail + i) % LOG_RAM_RECORDS]);
+    }
+    record_count += log_ring_count;
+
+    printf("%u records\n", record_count);
+}
+
+void run_headless() {
+    quiet_output = true;
+    headless = true;
+    while (!tud_cdc_connected()) {
+        if (EXTERNAL_REFERENCE && !track_external_reference()) continue;
+
+        double complex* voltages = measure_voltages(get_measurement_profile()->iterations);
+        if (voltages == NULL) continue;
+
+        add_log_record(voltages, get_temperature());
+        free(voltages);
+    }
+    headless = false;
+    quiet_output = false;
+}
+
+// Commands that work the same at every prompt, so the host tools can send them without following the menu: the
+// streams, the monitor (of the voltages only, before there's a calibration), the log dump, the profile selection
+// (only of the profiles that fit the calibration, once there's one), and Q, which stops the streams and the
+// monitor and is otherwise ignored
+bool run_common_command(char command, bool calibrated, double complex* open_circuit_voltages,
+    double calibration_temperature, char component) {
+    if (command == 'S' || command == 's') run_stream(STREAM_FRAME_CAPTURE);
+    else if (command == 'P' || command == 'p') select_measurement_profile(calibrated);
+    else if (command == 'U' || command == 'u') run_stream(STREAM_FRAME_TEST);
+    else if (command == 'M' || command == 'm') run_monitor(open_circuit_voltages, calibration_temperature, component);
+    else if (command == 'D' || command == 'd') dump_log();
+    else if (command != 'Q' && command != 'q') return false;
+
+    return true;
+}
+
+int main()
+{
+    // Overclocks the device
+    set_sys_clock_hz(CLOCK_FREQ_HZ, true);
+
+    // Initializes the USB stuff
+    stdio_init_all();
+
+    // The cycle counter times the benchmark and the capture latency
+    start_cycle_counter();
+
+    bool success = init_adc();
+    if (!success) return 1;
+
+    load_adc_correction();
+    load_measurement_profile();
+
+    // With an external reference the sampling follows its frequency, measured before every measurement
+    if (EXTERNAL_REFERENCE) success = track_external_reference();
+    else success = init_profile_sampling();
+    if (!success) return 1;
+
+    init_mux();
+    init_trigger();
+    if (!load_log()) return 1;
+
+    // Wait for USB connection, logging measurements in the meantime if it takes too long
+    uint64_t boot_us = time_us_64();
+    while (!tud_cdc_connected()) {
+        if (time_us_64() - boot_us > HEADLESS_DELAY_US) run_headless();
+        else sleep_ms(100);
+    }
+
+    // Clear the screen
+    printf("\e[1;1H\e[2J");
+
+    print_sampling_plan();
+    printf("Measurement profile: %s\n", get_measurement_profile()->name);
+    printf("Logged records: %u\n", (uint) log_record_sequence);
+
+    printf("\n-------------------------------------------------\n");
+    printf("Set up every DUT as open circuit and press Enter (or B to run the benchmark, L to calibrate the ADC, N to characterize the noise floor of the measurement profiles, P to select the measurement profile, D to dump the log, S to stream captures, U to test the stream throughput, M to monitor the voltages)...\n");
+    while (true) {
+        char command = getchar();
+        if (command == 'B' || command == 'b') run_benchmark();
+        else if (command == 'L' || command == 'l') calibrate_adc_correction();
+        else if (command == 'N' || command == 'n') {
+            if (!characterize_profiles()) return 1;
+        } else if (!run_common_command(command, false, NULL, 0, 0)) break;
+
+        printf("\nSet up every DUT as open circuit and press Enter (or B to run the benchmark, L to calibrate the ADC, N to characterize the noise floor of the measurement profiles, P to select the measurement profile, D to dump the log, S to stream captures, U to test the stream throughput, M to monitor the voltages)...\n");
+    }
+
+    if (EXTERNAL_REFERENCE && !track_external_reference()) return 1;
+    double calibration_frequency = sampling_plan.frequency_hz;
+
+    double complex* open_circuit_voltages = measure_voltages(get_measurement_profile()->iterations);
+    if (open_circuit_voltages == NULL) return 1;
+
+    double calibration_temperature = get_temperature();
+    if (TEMPERATURE_SENSING) printf("Calibration temperature: %.2lf C\n", calibration_temperature);
+
+    printf("\nSet up the DUT as the impedance to be measured...\n");
+    printf("When configured, input R for resistance measurement and C for capacitance (or P to select the measurement profile)...\n");
+    char component = getchar();
+    while (run_common_command(component, true, NULL, 0, 0)) {
+        printf("\nWhen configured, input R for resistance measurement and C for capacitance (or P to select the measurement profile)...\n");
+        component = getchar();
+    }
+
+    while (true) {
+        if (EXTERNAL_REFERENCE && !track_external_reference()) return 1;
+
+        // The open circuit voltages were only measured at the calibration frequency
+        if (sampling_plan.frequency_hz != calibration_frequency) {
+            printf("WARNING: REFERENCE FREQUENCY CHANGED SINCE CALIBRATION!\n");
+        }
+
+        double complex* dut_voltages = measure_voltages(get_measurement_profile()->iterations);
+        if (dut_voltages == NULL) return 1;
+
+        // Without the sensor there's no temperature to compensate for
+        double temperature = get_temperature();
+        double temperature_delta = TEMPERATURE_SENSING ? temperature - calibration_temperature : 0;
+        if (TEMPERATURE_SENSING) printf("Temperature: %.2lf C (%+.2lf C from calibration)\n", temperature, temperature_delta);
+
+        // Each DUT position and demodulated frequency has its own open circuit voltage, so calculate them separately
+        uint voltage_count = get_voltage_count();
+        for (int d = 0; d < DUT_POSITION_COUNT; d++) {
+            if (DUT_POSITION_COUNT > 1) printf("\n");
+            print_dut_label(d);
+            if (DUT_POSITION_COUNT > 1) printf("\n");
+
+            for (int i = 0; i < voltage_count; i++) {
+                uint index = d * voltage_count + i;
+                double complex result = calculate_result(open_circuit_voltages[index], dut_voltages[index], temperature_delta);
+                print_result(result, component, get_voltage_frequency(i));
+            }
+        }
+
+        printf("\nTo measure again, input R for resistance measurement and C for capacitance (or H to bin parts from a handler, T for triggered single shots, P to select the measurement profile, M to monitor, D to dump the log, S to stream captures, U to test the stream throughput)...\n");
+        char command = getchar();
+        while (true) {
+            if (command == 'H' || command == 'h') run_binning(open_circuit_voltages, calibration_temperature, component);
+            else if (command == 'T' || command == 't') run_triggered(open_circuit_voltages, calibration_temperature, component);
+            else if (!run_common_command(command, true, open_circuit_voltages, calibration_temperature, component)) break;
+
+            printf("\nTo measure again, input R for resistance measurement and C for capacitance (or H to bin parts from a handler, T for triggered single shots, P to select the measurement profile, M to monitor, D to dump the log, S to stream captures, U to test the stream throughput)...\n");
+            command = getchar();
+        }
+        component = command;
 
-        free(dut_samples);
+        free(dut_voltages);
     }
 }
@@ -0,0 +1,53 @@
+#ifndef LOCKIN_STREAM_H
+#define LOCKIN_STREAM_H
+
+#include <stdint.h>
+
+// Binary frames sent on the vendor USB interface, shared with the host tools. Every frame is a header followed
+// by payload_size bytes, all little endian
+
+#define STREAM_FRAME_MAGIC 0x4D525453
+
+// Payload of the frame
+#define STREAM_FRAME_CAPTURE 1 // Raw ADC capture, channel_count channels of channel_length 16 bit samples each
+#define STREAM_FRAME_TEST 2 // Counting 32 bit words, to measure the link throughput
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    // Increases with every frame, including the dropped ones
+    uint32_t sequence;
+    uint32_t payload_size;
+    // Time the capture started, in microseconds since boot
+    uint64_t start_us;
+    // Sampling plan of the capture (see sampling_plan_t)
+    double frequency_hz;
+    uint32_t period_cycles;
+    uint32_t adc_period_256ths;
+    uint32_t samples_per_period;
+    // Channels one after the other: the reference and every DUT input
+    uint16_t channel_count;
+    // Excitation periods (of the first tone) held by the capture
+    uint16_t capture_periods;
+    uint32_t channel_length;
+    // Excitation PWM counters when the capture started, and the PWM setup of both tones
+    uint16_t start_pwm_count;
+    uint16_t pwm_wrap;
+    uint16_t start_second_pwm_count;
+    uint16_t second_pwm_wrap;
+    uint32_t pwm_divider_16ths;
+    uint32_t second_pwm_divider_16ths;
+    // Frames dropped since the stream started, because the host didn't read them fast enough
+    uint32_t dropped_count;
+    // Raw code of the temperature sensor, converted once right after the capture (0 without the sensor)
+    uint16_t temperature_code;
+    uint16_t reserved[3];
+} stream_frame_header_t;
+
+#ifdef __cplusplus
+static_assert(sizeof(stream_frame_header_t) == 80, "Unexpected padding in the stream frame header");
+#else
+_Static_assert(sizeof(stream_frame_header_t) == 80, "Unexpected padding in the stream frame header");
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+// TinyUSB setup of the composite device: the CDC console used by stdio and a vendor interface with a pair of
+// bulk endpoints for the binary stream
+
+#define CFG_TUSB_RHPORT0_MODE OPT_MODE_DEVICE
+
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 1
+#define CFG_TUD_VENDOR 1
+
+// Same console buffers as the stdio driver uses with its own descriptors
+#define CFG_TUD_CDC_RX_BUFSIZE 256
+#define CFG_TUD_CDC_TX_BUFSIZE 256
+
+// The stream is written a FIFO at a time with the USB interrupts held off, so this also bounds how long that takes
+#define CFG_TUD_VENDOR_RX_BUFSIZE 64
+#define CFG_TUD_VENDOR_TX_BUFSIZE 2048
+
+#endif
@@ -0,0 +1,121 @@
+#include <string.h>
+#include <tusb.h>
+#include "pico/unique_id.h"
+
+// Composite device with the CDC console (interfaces 0 and 1) and the vendor interface of the binary stream. Its
+// interfaces differ from the stock Pico stdio device, so it doesn't reuse that PID: it defaults to the pid.codes
+// test PID, which is only meant for development, and a build for distribution defines its own allocated IDs
+#ifndef USB_VID
+#define USB_VID 0x1209
+#endif
+#ifndef USB_PID
+#define USB_PID 0x0001
+#endif
+#define USB_BCD_DEVICE 0x0101
+
+enum {
+    ITF_NUM_CDC,
+    ITF_NUM_CDC_DATA,
+    ITF_NUM_VENDOR,
+    ITF_NUM_TOTAL
+};
+
+#define EPNUM_CDC_NOTIF 0x81
+#define EPNUM_CDC_OUT 0x02
+#define EPNUM_CDC_IN 0x82
+#define EPNUM_VENDOR_OUT 0x03
+#define EPNUM_VENDOR_IN 0x83
+
+#define CDC_NOTIF_SIZE 8
+// Full speed bulk endpoints are at most 64 bytes
+#define BULK_PACKET_SIZE 64
+
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN)
+
+enum {
+    STRING_LANGUAGE,
+    STRING_MANUFACTURER,
+    STRING_PRODUCT,
+    STRING_SERIAL,
+    STRING_CDC,
+    STRING_VENDOR
+};
+
+const tusb_desc_device_t device_descriptor = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+
+    // Interface association descriptors group the two CDC interfaces
+    .bDeviceClass = TUSB_CLASS_MISC,
+    .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+
+    .idVendor = USB_VID,
+    .idProduct = USB_PID,
+    .bcdDevice = USB_BCD_DEVICE,
+
+    .iManufacturer = STRING_MANUFACTURER,
+    .iProduct = STRING_PRODUCT,
+    .iSerialNumber = STRING_SERIAL,
+
+    .bNumConfigurations = 1
+};
+
+const uint8_t configuration_descriptor[] = {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 250),
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRING_CDC, EPNUM_CDC_NOTIF, CDC_NOTIF_SIZE, EPNUM_CDC_OUT, EPNUM_CDC_IN,
+        BULK_PACKET_SIZE),
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, STRING_VENDOR, EPNUM_VENDOR_OUT, EPNUM_VENDOR_IN, BULK_PACKET_SIZE)
+};
+
+const char* string_descriptors[] = {
+    [STRING_MANUFACTURER] = "Raspberry Pi",
+    [STRING_PRODUCT] = "Lock-in Pico",
+    [STRING_CDC] = "Lock-in Pico Console",
+    [STRING_VENDOR] = "Lock-in Pico Data"
+};
+
+const uint8_t* tud_descriptor_device_cb() {
+    return (const uint8_t*) &device_descriptor;
+}
+
+const uint8_t* tud_descriptor_configuration_cb(uint8_t index) {
+    (void) index;
+
+    return configuration_descriptor;
+}
+
+const uint16_t* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+    // UTF-16 descriptor, the first element holds the type and the length in bytes
+    static uint16_t descriptor[1 + 32];
+    size_t length;
+
+    if (index == STRING_LANGUAGE) {
+        descriptor[1] = 0x0409; // English
+        length = 1;
+    } else {
+        char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+        const char* string;
+
+        if (index == STRING_SERIAL) {
+            pico_get_unique_board_id_string(serial, sizeof(serial));
+            string = serial;
+        } else if (index < sizeof(string_descriptors) / sizeof(string_descriptors[0]) && string_descriptors[index]) {
+            string = string_descriptors[index];
+        } else {
+            return NULL;
+        }
+
+        length = strlen(string);
+        if (length > 32) length = 32;
+        for (int i = 0; i < length; i++) {
+            descriptor[1 + i] = string[i];
+        }
+    }
+
+    descriptor[0] = (TUSB_DESC_STRING << 8) | (2 * length + 2);
+
+    return descriptor;
+}